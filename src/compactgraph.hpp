@@ -0,0 +1,325 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+#include <assert.h>
+#include <vector>
+#include <string>
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+using namespace std;
+
+/***
+ * @brief Compressed adjacency lists of a k-NN graph, as an alternative
+ * to the raw vector<vector<unsigned>> kept by NNSearch.
+ *
+ * Each neighbor list is sorted and delta coded, and the deltas are
+ * packed in the "stream vbyte" layout:
+ *
+ *   [n: varint][ceil(n/4) control bytes][packed deltas]
+ *
+ * where each control byte holds the byte lengths (1..4) of 4 deltas.
+ * This layout decodes 4 ids at a time with one shuffle (SSSE3) and a
+ * prefix sum, without any branch on the data. The ids can be reordered
+ * by BFS beforehand, which keeps neighbors close in id space and most
+ * deltas in one byte.
+ *
+ * @copyright All rights are reserved by the author
+ */
+
+namespace cmmlab
+{
+    class CompactGraph
+    {
+    private:
+        std::vector<uint64_t> offsets; // where the list of node i starts in 'bytes'
+        std::vector<uint8_t> bytes;
+        unsigned maxDeg{0};
+        size_t idBound{0}; // largest neighbor id + 1
+
+        static const unsigned PADDING = 16; // the decoder reads 16 bytes at once
+
+    public:
+        size_t size() const
+        {
+            return offsets.empty() ? 0 : offsets.size() - 1;
+        }
+
+        // decode() writes up to maxDegree() rounded up to 4 ids
+        unsigned maxDegree() const
+        {
+            return maxDeg;
+        }
+
+        size_t memoryBytes() const
+        {
+            return offsets.size() * sizeof(uint64_t) + bytes.size();
+        }
+
+        void clear()
+        {
+            offsets.clear();
+            bytes.clear();
+            maxDeg = 0;
+            idBound = 0;
+        }
+
+        /**
+         * encode an ivecs graph row by row, so the raw graph is never
+         * held in memory as a whole
+         */
+        void loadIVECS(string srcPath)
+        {
+            ifstream inStrm(srcPath, ios::binary);
+            if (!inStrm.is_open())
+            {
+                std::cerr << "File '" << srcPath << "' cannot open for read!\n";
+                exit(0);
+            }
+            clear();
+            offsets.push_back(0);
+            unsigned int dim = 0;
+            std::vector<unsigned> row;
+            while (inStrm.read((char *)&dim, sizeof(unsigned int)))
+            {
+                row.resize(dim);
+                inStrm.read((char *)row.data(), dim * sizeof(unsigned int));
+                append(row);
+            }
+            inStrm.close();
+            seal(srcPath);
+        }
+
+        void build(const std::vector<std::vector<unsigned>> &graph)
+        {
+            clear();
+            offsets.push_back(0);
+            std::vector<unsigned> row;
+            for (size_t i = 0; i < graph.size(); i++)
+            {
+                row = graph[i];
+                append(row);
+            }
+            seal("graph");
+        }
+
+        /**
+         * new id of each node, in the order nodes are met by BFS
+         * (each connected component is started from its smallest id)
+         */
+        std::vector<unsigned> bfsOrder() const
+        {
+            size_t n = size();
+            std::vector<unsigned> newId(n, (unsigned)-1);
+            std::vector<unsigned> fifo;
+            std::vector<unsigned> nbs(maxDeg + 4);
+            fifo.reserve(n);
+            unsigned next = 0;
+            for (size_t s = 0; s < n; s++)
+            {
+                if (newId[s] != (unsigned)-1)
+                {
+                    continue;
+                }
+                size_t head = fifo.size();
+                fifo.push_back(s);
+                newId[s] = next++;
+                while (head < fifo.size())
+                {
+                    unsigned nbn = decode(fifo[head++], nbs.data());
+                    for (unsigned j = 0; j < nbn; j++)
+                    {
+                        if (newId[nbs[j]] == (unsigned)-1)
+                        {
+                            newId[nbs[j]] = next++;
+                            fifo.push_back(nbs[j]);
+                        }
+                    }
+                }
+            }
+            return newId;
+        }
+
+        /**
+         * relabel node i as newId[i] (a permutation), and re-encode
+         */
+        void reorder(const std::vector<unsigned> &newId)
+        {
+            size_t n = size();
+            assert(newId.size() == n);
+            std::vector<unsigned> oldId(n);
+            for (size_t i = 0; i < n; i++)
+            {
+                oldId[newId[i]] = i;
+            }
+            CompactGraph out;
+            out.offsets.reserve(n + 1);
+            out.bytes.reserve(bytes.size());
+            out.offsets.push_back(0);
+            std::vector<unsigned> row(maxDeg + 4);
+            for (size_t v = 0; v < n; v++)
+            {
+                unsigned nbn = decode(oldId[v], row.data());
+                row.resize(nbn);
+                for (unsigned j = 0; j < nbn; j++)
+                {
+                    row[j] = newId[row[j]];
+                }
+                out.append(row);
+                row.resize(maxDeg + 4);
+            }
+            out.seal("reordered graph");
+            this->swap(out);
+        }
+
+        void swap(CompactGraph &other)
+        {
+            offsets.swap(other.offsets);
+            bytes.swap(other.bytes);
+            std::swap(maxDeg, other.maxDeg);
+            std::swap(idBound, other.idBound);
+        }
+
+        /**
+         * decode the (ascending) neighbor ids of 'node' into 'out', which
+         * must have room for maxDegree() + 3 ids; returns the number of ids
+         */
+        inline unsigned decode(unsigned node, unsigned *out) const
+        {
+            const uint8_t *p = bytes.data() + offsets[node];
+            unsigned n = 0, shift = 0;
+            while (*p & 0x80)
+            {
+                n |= (*p++ & 0x7f) << shift;
+                shift += 7;
+            }
+            n |= *p++ << shift;
+
+            const uint8_t *ctrl = p;
+            const uint8_t *data = p + (n + 3) / 4;
+            unsigned ngroup = (n + 3) / 4;
+#ifdef __SSSE3__
+            const Tables &tab = tables();
+            __m128i prev = _mm_setzero_si128();
+            for (unsigned g = 0; g < ngroup; g++)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i *)data);
+                v = _mm_shuffle_epi8(v, _mm_loadu_si128((const __m128i *)tab.shuffle[ctrl[g]]));
+                // prefix sum over the 4 deltas, plus the last id of the previous group
+                v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+                v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+                v = _mm_add_epi32(v, prev);
+                _mm_storeu_si128((__m128i *)(out + 4 * g), v);
+                prev = _mm_shuffle_epi32(v, 0xff);
+                data += tab.length[ctrl[g]];
+            }
+#else
+            unsigned prev = 0;
+            for (unsigned g = 0; g < ngroup; g++)
+            {
+                unsigned c = ctrl[g];
+                for (unsigned k = 0; k < 4; k++)
+                {
+                    unsigned len = ((c >> (2 * k)) & 3) + 1;
+                    uint32_t delta = 0;
+                    memcpy(&delta, data, 4); // little-endian, safe thanks to PADDING
+                    delta &= len == 4 ? 0xffffffffu : ((1u << (8 * len)) - 1);
+                    data += len;
+                    prev += delta;
+                    out[4 * g + k] = prev;
+                }
+            }
+#endif
+            return n;
+        }
+
+    private:
+        struct Tables
+        {
+            uint8_t shuffle[256][16];
+            uint8_t length[256];
+
+            Tables()
+            {
+                for (unsigned c = 0; c < 256; c++)
+                {
+                    unsigned pos = 0;
+                    for (unsigned k = 0; k < 4; k++)
+                    {
+                        unsigned len = ((c >> (2 * k)) & 3) + 1;
+                        for (unsigned b = 0; b < 4; b++)
+                        {
+                            shuffle[c][4 * k + b] = b < len ? pos + b : 0x80;
+                        }
+                        pos += len;
+                    }
+                    length[c] = pos;
+                }
+            }
+        };
+
+        static const Tables &tables()
+        {
+            static const Tables tab;
+            return tab;
+        }
+
+        // every neighbor id must be a node: decode() results index arrays of size()
+        void seal(const std::string &srcName)
+        {
+            if (idBound > size())
+            {
+                std::cerr << "Neighbor id " << idBound - 1 << " in '" << srcName << "' is out of range (" << size()
+                          << " nodes)!\n";
+                exit(0);
+            }
+            bytes.resize(bytes.size() + PADDING, 0);
+        }
+
+        void append(std::vector<unsigned> &row)
+        {
+            std::sort(row.begin(), row.end());
+            unsigned n = row.size();
+            maxDeg = std::max(maxDeg, n);
+            if (n > 0)
+            {
+                idBound = std::max<size_t>(idBound, (size_t)row.back() + 1);
+            }
+
+            unsigned x = n;
+            while (x >= 0x80)
+            {
+                bytes.push_back((x & 0x7f) | 0x80);
+                x >>= 7;
+            }
+            bytes.push_back(x);
+
+            size_t ctrlPos = bytes.size();
+            bytes.resize(bytes.size() + (n + 3) / 4, 0);
+            unsigned prev = 0;
+            for (unsigned j = 0; j < n; j++)
+            {
+                uint32_t delta = row[j] - prev;
+                prev = row[j];
+                unsigned len = delta < (1u << 8) ? 1 : delta < (1u << 16) ? 2 : delta < (1u << 24) ? 3 : 4;
+                bytes[ctrlPos + j / 4] |= (len - 1) << (2 * (j % 4));
+                for (unsigned b = 0; b < len; b++)
+                {
+                    bytes.push_back((delta >> (8 * b)) & 0xff);
+                }
+            }
+            // the unused lanes of the last group are coded as 1-byte zeros
+            for (unsigned j = n; j % 4 != 0; j++)
+            {
+                bytes.push_back(0);
+            }
+            offsets.push_back(bytes.size());
+        }
+    };
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <vector>
+#include <string>
+
+using namespace std;
+
+/***
+ * @brief The table of operating points found by EfTuner: for a topk
+ * and a target recall, the smallest efrange tried and the recall it
+ * measured on the tuning queries (below the target if even the largest
+ * efrange tried could not reach it). It is kept next to the index, in a
+ * text file '<index>.eftab' with one "topk target efrange recall metric
+ * compact" line per entry, and lets NNSearch be called with a recall
+ * target instead of efrange.
+ *
+ * An efrange only holds for the metric and the graph layout (compact or
+ * not) it was tuned with. The table serves the entries of its own mode
+ * (see setMode()); the others are only kept to be saved back.
+ *
+ * @copyright All rights are reserved by the author
+ */
+
+namespace cmmlab
+{
+    struct EfEntry
+    {
+        size_t topk;
+        float target;
+        size_t efrange;
+        float recall; // as measured on the tuning queries
+        std::string metric;
+        bool compact;
+    };
+
+    class EfTable
+    {
+    private:
+        std::vector<EfEntry> entries; // of the current mode
+        std::vector<EfEntry> others;  // of other modes, or unreadable
+        std::string metric{"l2"};
+        bool compact{false};
+
+    public:
+        static std::string pathFor(const std::string &indexFn)
+        {
+            return indexFn + ".eftab";
+        }
+
+        // the metric name and graph layout of the search, to be set before load()
+        void setMode(const std::string &metric0, bool compact0)
+        {
+            metric = metric0;
+            compact = compact0;
+        }
+
+        bool empty() const
+        {
+            return entries.empty();
+        }
+
+        const std::vector<EfEntry> &getEntries() const
+        {
+            return entries;
+        }
+
+        // number of loaded entries that were not tuned in the current mode
+        size_t skipped() const
+        {
+            return others.size();
+        }
+
+        // replaces the entry of the same (topk, target), if any
+        void set(size_t topk, float target, size_t efrange, float recall)
+        {
+            for (EfEntry &e : entries)
+            {
+                if (e.topk == topk && e.target == target)
+                {
+                    e.efrange = efrange;
+                    e.recall = recall;
+                    return;
+                }
+            }
+            EfEntry e = {topk, target, efrange, recall, metric, compact};
+            entries.push_back(e);
+            std::sort(entries.begin(), entries.end(), [](const EfEntry &a, const EfEntry &b)
+                      { return a.topk < b.topk || (a.topk == b.topk && a.target < b.target); });
+        }
+
+        /**
+         * the cheapest efrange tuned for 'topk' whose measured recall is no
+         * lower than 'target'; 0 if there is none (target out of reach, or
+         * 'topk' never tuned)
+         */
+        size_t lookup(size_t topk, float target) const
+        {
+            size_t best = 0;
+            for (const EfEntry &e : entries)
+            {
+                if (e.topk == topk && e.recall >= target && (best == 0 || e.efrange < best))
+                {
+                    best = e.efrange;
+                }
+            }
+            return best;
+        }
+
+        // the largest efrange tuned for 'topk', 0 if 'topk' was never tuned
+        size_t largest(size_t topk) const
+        {
+            size_t ef = 0;
+            for (const EfEntry &e : entries)
+            {
+                if (e.topk == topk)
+                {
+                    ef = std::max(ef, e.efrange);
+                }
+            }
+            return ef;
+        }
+
+        bool load(const std::string &srcPath)
+        {
+            ifstream inStrm(srcPath);
+            if (!inStrm.is_open())
+            {
+                return false;
+            }
+            entries.clear();
+            others.clear();
+            std::string line;
+            while (std::getline(inStrm, line))
+            {
+                if (line.empty() || line[0] == '#')
+                {
+                    continue;
+                }
+                std::istringstream iss(line);
+                EfEntry e;
+                if (!(iss >> e.topk >> e.target >> e.efrange >> e.recall >> e.metric >> e.compact))
+                {
+                    e.metric = "?"; // no mode given, cannot be trusted
+                    e.compact = false;
+                }
+                if (e.metric == metric && e.compact == compact)
+                {
+                    set(e.topk, e.target, e.efrange, e.recall);
+                }
+                else
+                {
+                    others.push_back(e);
+                }
+            }
+            inStrm.close();
+            return true;
+        }
+
+        void save(const std::string &destPath) const
+        {
+            ofstream outStrm(destPath);
+            if (!outStrm.is_open())
+            {
+                std::cerr << "File '" << destPath << "' cannot open for write!" << std::endl;
+                exit(0);
+            }
+            outStrm << "# topk target efrange recall metric compact\n";
+            for (const EfEntry &e : entries)
+            {
+                write(outStrm, e);
+            }
+            for (const EfEntry &e : others)
+            {
+                if (e.metric != "?") // unreadable lines are not written back
+                {
+                    write(outStrm, e);
+                }
+            }
+            outStrm.close();
+        }
+
+    private:
+        static void write(ofstream &outStrm, const EfEntry &e)
+        {
+            outStrm << e.topk << " " << e.target << " " << e.efrange << " " << e.recall << " "
+                    << e.metric << " " << e.compact << "\n";
+        }
+    };
+}
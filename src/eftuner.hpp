@@ -0,0 +1,108 @@
+#pragma once
+
+#include "nnsearch.hpp"
+#include "eftable.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <string>
+
+/***
+ * @brief Finds, for a topk and a target recall (e.g. 0.95@10), the
+ * cheapest efrange reaching the target on a sample of queries, by
+ * binary search over efrange (recall grows with efrange). The ground
+ * truth is either given, or computed by brute force on the sample.
+ * Results go into the EfTable of the NNSearch, to be saved next to
+ * the index.
+ *
+ * @copyright All rights are reserved by the author
+ */
+
+namespace cmmlab
+{
+    template <class Search = NNSearch<>>
+    class EfTuner
+    {
+    private:
+        Search &nns;
+        std::vector<std::vector<float>> queries;
+        std::vector<std::vector<unsigned>> gt;
+
+    public:
+        /**
+         * the first 'nSample' queries are used; if 'gt0' is empty, their
+         * exact top-'maxTopk' is computed by brute force
+         */
+        EfTuner(Search &nns0, const std::vector<std::vector<float>> &queries0,
+                const std::vector<std::vector<unsigned>> &gt0, size_t nSample, size_t maxTopk)
+            : nns(nns0)
+        {
+            nSample = std::min(nSample, queries0.size());
+            if (!gt0.empty())
+            {
+                nSample = std::min(nSample, gt0.size());
+            }
+            queries.assign(queries0.begin(), queries0.begin() + nSample);
+            if (!gt0.empty())
+            {
+                gt.assign(gt0.begin(), gt0.begin() + nSample);
+            }
+            else
+            {
+                std::cout << "Brute-force ground truth of " << nSample << " queries ..." << std::endl;
+                gt.resize(nSample);
+                for (size_t i = 0; i < nSample; i++)
+                {
+                    gt[i] = nns.exactSearch(queries[i].data(), maxTopk);
+                }
+            }
+        }
+
+        float recallAt(size_t topk, size_t efrange)
+        {
+            std::vector<std::vector<unsigned>> res(queries.size());
+            for (size_t i = 0; i < queries.size(); i++)
+            {
+                res[i] = nns.nnSearch(queries[i].data(), topk, efrange);
+            }
+            return Metrics::getRecall(res, gt, topk);
+        }
+
+        /**
+         * the smallest efrange in [topk, maxEf] with recall@topk >= target,
+         * stored into the EfTable of the NNSearch; if even maxEf does not
+         * reach the target, a warning is printed and maxEf is stored with
+         * its (lower) recall, which EfTable::lookup() will not select
+         */
+        size_t tune(size_t topk, float target, size_t maxEf)
+        {
+            size_t lo = topk, hi = std::max(maxEf, topk);
+            float hiRecall = recallAt(topk, hi);
+            if (hiRecall < target)
+            {
+                std::cerr << "Recall " << target << "@" << topk << " is not reached with efrange " << hi
+                          << " (" << hiRecall << ")!" << std::endl;
+                nns.getEfTable().set(topk, target, hi, hiRecall);
+                return hi;
+            }
+            while (lo < hi)
+            {
+                size_t mid = lo + (hi - lo) / 2;
+                float recall = recallAt(topk, mid);
+                std::cout << "  topk = " << topk << ", efrange = " << mid << ", recall = " << recall << std::endl;
+                if (recall >= target)
+                {
+                    hi = mid;
+                    hiRecall = recall;
+                }
+                else
+                {
+                    lo = mid + 1;
+                }
+            }
+            nns.getEfTable().set(topk, target, hi, hiRecall);
+            return hi;
+        }
+    };
+}
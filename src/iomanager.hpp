@@ -10,6 +10,10 @@
 #include <assert.h>
 #include <vector>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -107,6 +111,61 @@ namespace cmmlab
             return matrix;
         }
 
+        // dimension of the vectors in an fvecs file, read from its first row
+        static size_t peekFVECSDim(string srcPath)
+        {
+            ifstream inStrm(srcPath, ios::binary);
+            if (!inStrm.is_open())
+            {
+                std::cerr << "File '" << srcPath << "' cannot open for read!\n";
+                exit(0);
+            }
+            unsigned int dim = 0;
+            inStrm.read((char *)&dim, sizeof(unsigned int));
+            inStrm.close();
+            return dim;
+        }
+
+        /**
+         * map an fvecs file read-only instead of loading it, so the OS can
+         * page vectors in and out. The returned pointer is the start of the
+         * file: vector i starts at 'map + i * (nDim + 1) + 1' (one dim word
+         * per row). Release it with unmapFVECS().
+         */
+        static float *mapFVECS(string srcPath, size_t &nRow, size_t &nDim, size_t &mapLen)
+        {
+            int fd = open(srcPath.c_str(), O_RDONLY);
+            if (fd < 0)
+            {
+                std::cerr << "File '" << srcPath << "' cannot open for read!\n";
+                exit(0);
+            }
+            struct stat st;
+            fstat(fd, &st);
+            mapLen = st.st_size;
+            unsigned int dim = 0;
+            if (mapLen < sizeof(unsigned int) || read(fd, &dim, sizeof(unsigned int)) != sizeof(unsigned int))
+            {
+                std::cerr << "File '" << srcPath << "' is empty!\n";
+                exit(0);
+            }
+            void *map = mmap(nullptr, mapLen, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (map == MAP_FAILED)
+            {
+                std::cerr << "File '" << srcPath << "' cannot be mapped!\n";
+                exit(0);
+            }
+            nDim = dim;
+            nRow = mapLen / (sizeof(unsigned int) + dim * sizeof(float));
+            return (float *)map;
+        }
+
+        static void unmapFVECS(float *map, size_t mapLen)
+        {
+            munmap(map, mapLen);
+        }
+
         static vector<vector<unsigned int>> loadIVECS(string srcPath, size_t &nRow, size_t &nDim)
         {
             vector<vector<unsigned int>> matrix;
@@ -170,6 +229,33 @@ namespace cmmlab
             return matrix;
         }
 
+        static void saveFVECS(string destPath, vector<vector<float>> &data)
+        {
+            auto outStrm = std::fstream(destPath, ios::out | ios::binary);
+            if (!outStrm.is_open())
+            {
+                std::cerr << "File '" << destPath << "' cannot open for write!" << std::endl;
+                exit(0);
+            }
+            for (size_t i = 0; i < data.size(); ++i)
+            {
+                unsigned int dim = data[i].size();
+                outStrm.write((char *)&dim, sizeof(unsigned int));
+                outStrm.write((char *)data[i].data(), dim * sizeof(float));
+            }
+            outStrm.close();
+        }
+
+        /**
+         * the per-vector values a metric precomputes at index build (e.g.
+         * the inverse norms for cosine) are kept next to the index, as a
+         * single-row fvecs file
+         */
+        static string normsPathFor(string indexPath)
+        {
+            return indexPath + ".norms";
+        }
+
          static void saveIVECS(string destPath, vector<vector<unsigned>> &data)
         {
             unsigned int size_n = data.size();
@@ -1,30 +1,211 @@
 #pragma once;
 
 #include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
 
 
 /***
  * @author Wan-Lei Zhao
  * @date   2024-12-10
- * 
+ *
  * @copyright All rights are reserved by the author
  */
 
 namespace cmmlab
 {
+    /**
+     * SIMD kernels. DIM = 0 takes 'dim' at run time. With DIM > 0 the
+     * trip count is a compile-time constant: the 8-wide and scalar tail
+     * loops are dropped when DIM is a multiple of 16. GCC 12 with -Ofast unrolls
+     * the main loop fully for 96 and 128, but keeps it rolled for 768
+     * (48 iterations), where DIM only saves the tails and the bound checks.
+     * This is what the DIM parameter of NNSearch and GraphDiverse selects.
+     */
+#ifdef __AVX__
+    inline float hsum256(__m256 v)
+    {
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+        return _mm_cvtss_f32(s);
+    }
+
+    inline __m256 madd256(__m256 x, __m256 y, __m256 acc)
+    {
+#ifdef __FMA__
+        return _mm256_fmadd_ps(x, y, acc);
+#else
+        return _mm256_add_ps(acc, _mm256_mul_ps(x, y));
+#endif
+    }
+#endif
+
+    template <size_t DIM>
+    inline float l2sqr(const float *vect1, const float *vect2, size_t dim)
+    {
+        const size_t n = DIM > 0 ? DIM : dim;
+        size_t i = 0;
+        float dist = 0;
+#ifdef __AVX__
+        __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+        for (; i + 16 <= n; i += 16)
+        {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(vect1 + i), _mm256_loadu_ps(vect2 + i));
+            __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(vect1 + i + 8), _mm256_loadu_ps(vect2 + i + 8));
+            acc0 = madd256(d0, d0, acc0);
+            acc1 = madd256(d1, d1, acc1);
+        }
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(vect1 + i), _mm256_loadu_ps(vect2 + i));
+            acc0 = madd256(d0, d0, acc0);
+        }
+        dist = hsum256(_mm256_add_ps(acc0, acc1));
+#endif
+        for (; i < n; i++)
+        {
+            float delta = vect1[i] - vect2[i];
+            dist += delta * delta;
+        }
+        return dist;
+    }
+
+    template <size_t DIM>
+    inline float dotprod(const float *vect1, const float *vect2, size_t dim)
+    {
+        const size_t n = DIM > 0 ? DIM : dim;
+        size_t i = 0;
+        float prod = 0;
+#ifdef __AVX__
+        __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+        for (; i + 16 <= n; i += 16)
+        {
+            acc0 = madd256(_mm256_loadu_ps(vect1 + i), _mm256_loadu_ps(vect2 + i), acc0);
+            acc1 = madd256(_mm256_loadu_ps(vect1 + i + 8), _mm256_loadu_ps(vect2 + i + 8), acc1);
+        }
+        for (; i + 8 <= n; i += 8)
+        {
+            acc0 = madd256(_mm256_loadu_ps(vect1 + i), _mm256_loadu_ps(vect2 + i), acc0);
+        }
+        prod = hsum256(_mm256_add_ps(acc0, acc1));
+#endif
+        for (; i < n; i++)
+        {
+            prod += vect1[i] * vect2[i];
+        }
+        return prod;
+    }
+
+    /**
+     * Metrics plugged into NNSearch and GraphDiverse as a template
+     * parameter. A smaller distance means closer for all of them.
+     * 'aux' is a per-vector value precomputed once (stored with the index
+     * for base vectors, computed once per query), and passed to dist().
+     */
+    struct L2Metric
+    {
+        static const bool NEEDS_AUX = false;
+
+        static const char *name()
+        {
+            return "l2";
+        }
+
+        static float aux(const float *vect, size_t dim)
+        {
+            return 0;
+        }
+
+        template <size_t DIM>
+        static inline float dist(const float *vect1, const float *vect2, size_t dim, float aux1, float aux2)
+        {
+            return l2sqr<DIM>(vect1, vect2, dim);
+        }
+    };
+
+    // maximum inner product search: the distance is the negated inner product
+    struct IPMetric
+    {
+        static const bool NEEDS_AUX = false;
+
+        static const char *name()
+        {
+            return "ip";
+        }
+
+        static float aux(const float *vect, size_t dim)
+        {
+            return 0;
+        }
+
+        template <size_t DIM>
+        static inline float dist(const float *vect1, const float *vect2, size_t dim, float aux1, float aux2)
+        {
+            return -dotprod<DIM>(vect1, vect2, dim);
+        }
+    };
+
+    // 1 - cosine similarity, 'aux' being the inverse of the vector norm
+    struct CosineMetric
+    {
+        static const bool NEEDS_AUX = true;
+
+        static const char *name()
+        {
+            return "cos";
+        }
+
+        static float aux(const float *vect, size_t dim)
+        {
+            float norm = sqrt(dotprod<0>(vect, vect, dim));
+            return norm > 0 ? 1.0f / norm : 0;
+        }
+
+        template <size_t DIM>
+        static inline float dist(const float *vect1, const float *vect2, size_t dim, float aux1, float aux2)
+        {
+            return 1.0f - dotprod<DIM>(vect1, vect2, dim) * aux1 * aux2;
+        }
+    };
 
     class Metrics
     {
     public:
         static float l2dst(float *vect1, float *vect2, size_t dim)
         {
-            float dist = 0, delta = 0;
-            for (unsigned i = 0; i < dim; i++)
+            return l2sqr<0>(vect1, vect2, dim);
+        }
+
+        /**
+         * recall@checkK of the answers 'anng' against the ground truth
+         * 'knng', over the queries both have; a short (or missing)
+         * answer counts its absent ids as misses
+         */
+        static float getRecall(const std::vector<std::vector<unsigned>> &anng,
+                               const std::vector<std::vector<unsigned>> &knng, size_t checkK)
+        {
+            size_t hit = 0;
+            size_t checkN = std::min(anng.size(), knng.size());
+            for (size_t i = 0; i < checkN; ++i)
             {
-                delta = vect1[i] - vect2[i];
-                dist += delta * delta;
+                const auto &ann = anng[i];
+                const auto &knn = knng[i];
+                size_t kk = std::min(checkK, knn.size());
+                for (size_t j = 0; j < std::min(checkK, ann.size()); ++j)
+                {
+                    if (std::find(knn.begin(), knn.begin() + kk, ann[j]) != knn.begin() + kk)
+                    {
+                        ++hit;
+                    }
+                }
             }
-            return dist;
+            return checkN > 0 ? 1.0 * hit / (checkK * checkN) : 0;
         }
     };
-}
\ No newline at end of file
+}
@@ -0,0 +1,295 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <cstring>
+#include <atomic>
+#include <ostream>
+#include <vector>
+#include <string>
+
+/***
+ * @brief Wire format shared by NNServer and its clients, plus the
+ * socket and latency-counter helpers both sides need.
+ *
+ * Every message is a fixed little header followed by a payload of
+ * 4-byte words, all in host byte order (the server is local only).
+ *
+ *  request : ReqHeader + dim x float    (OP_SEARCH)
+ *            ReqHeader                  (OP_STATS, dim = 0)
+ *  response: RspHeader + count x uint32 (OP_SEARCH, the knn ids)
+ *            RspHeader + count x uint64 (OP_STATS, see printStats())
+ *
+ * A header with a bad magic, op or dim gets an error status and the
+ * connection is closed, as the rest of the stream cannot be parsed.
+ *
+ * @copyright All rights are reserved by the author
+ */
+
+namespace cmmlab
+{
+    namespace nnproto
+    {
+        const uint32_t MAGIC = 0x3153534e; // "NSS1"
+
+        enum Op
+        {
+            OP_SEARCH = 0,
+            OP_STATS = 1,
+            OP_NUM = 2
+        };
+
+        enum Status
+        {
+            ST_OK = 0,
+            ST_BAD_REQUEST = 1,
+            ST_BAD_DIM = 2,
+            ST_BUSY = 3 // the server queue is full, to be retried later
+        };
+
+        struct ReqHeader
+        {
+            uint32_t magic;
+            uint32_t op;
+            uint32_t reqId;
+            uint32_t topk;
+            uint32_t efrange;
+            uint32_t dim;
+        };
+
+        struct RspHeader
+        {
+            uint32_t reqId;
+            uint32_t status;
+            uint32_t count;
+        };
+
+        inline const char *opName(unsigned op)
+        {
+            static const char *names[OP_NUM] = {"search", "stats"};
+            return op < OP_NUM ? names[op] : "unknown";
+        }
+
+        inline bool readFull(int fd, void *buf, size_t n)
+        {
+            char *p = (char *)buf;
+            while (n > 0)
+            {
+                ssize_t r = ::read(fd, p, n);
+                if (r < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (r <= 0)
+                {
+                    return false;
+                }
+                p += r;
+                n -= r;
+            }
+            return true;
+        }
+
+        inline bool writeFull(int fd, const void *buf, size_t n)
+        {
+            const char *p = (const char *)buf;
+            while (n > 0)
+            {
+                ssize_t r = ::send(fd, p, n, MSG_NOSIGNAL);
+                if (r < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (r <= 0)
+                {
+                    return false;
+                }
+                p += r;
+                n -= r;
+            }
+            return true;
+        }
+
+        /**
+         * 'port' > 0 connects to 127.0.0.1:port, otherwise to the
+         * Unix domain socket at 'sockPath'. Returns -1 on failure.
+         */
+        inline int connectTo(const std::string &sockPath, unsigned short port)
+        {
+            int fd = -1;
+            if (port > 0)
+            {
+                fd = ::socket(AF_INET, SOCK_STREAM, 0);
+                if (fd < 0)
+                {
+                    return -1;
+                }
+                sockaddr_in addr;
+                memset(&addr, 0, sizeof(addr));
+                addr.sin_family = AF_INET;
+                addr.sin_port = htons(port);
+                addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                if (::connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+                {
+                    ::close(fd);
+                    return -1;
+                }
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            }
+            else
+            {
+                fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+                if (fd < 0)
+                {
+                    return -1;
+                }
+                sockaddr_un addr;
+                memset(&addr, 0, sizeof(addr));
+                addr.sun_family = AF_UNIX;
+                strncpy(addr.sun_path, sockPath.c_str(), sizeof(addr.sun_path) - 1);
+                if (::connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+                {
+                    ::close(fd);
+                    return -1;
+                }
+            }
+            return fd;
+        }
+
+        /**
+         * Lock-free latency counter: count, sum, max and a log2 histogram
+         * of microseconds, from which percentiles are estimated.
+         */
+        class LatencyCounter
+        {
+        public:
+            static const unsigned NBUCKETS = 32;
+            static const unsigned NWORDS = 3 + NBUCKETS; // size when serialized
+
+        private:
+            std::atomic<uint64_t> count, sumUs, maxUs;
+            std::atomic<uint64_t> hist[NBUCKETS];
+
+        public:
+            LatencyCounter() : count(0), sumUs(0), maxUs(0)
+            {
+                for (unsigned i = 0; i < NBUCKETS; i++)
+                {
+                    hist[i] = 0;
+                }
+            }
+
+            static unsigned bucketOf(uint64_t us)
+            {
+                unsigned b = 0;
+                while (us > 1 && b < NBUCKETS - 1)
+                {
+                    us >>= 1;
+                    b++;
+                }
+                return b;
+            }
+
+            void record(uint64_t us)
+            {
+                count.fetch_add(1, std::memory_order_relaxed);
+                sumUs.fetch_add(us, std::memory_order_relaxed);
+                hist[bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+                uint64_t m = maxUs.load(std::memory_order_relaxed);
+                while (us > m && !maxUs.compare_exchange_weak(m, us, std::memory_order_relaxed))
+                    ;
+            }
+
+            void serialize(std::vector<uint64_t> &out) const
+            {
+                out.push_back(count.load());
+                out.push_back(sumUs.load());
+                out.push_back(maxUs.load());
+                for (unsigned i = 0; i < NBUCKETS; i++)
+                {
+                    out.push_back(hist[i].load());
+                }
+            }
+
+            /**
+             * estimate the p-th percentile (0 < p < 1) from a serialized
+             * counter, interpolating linearly inside the log2 bucket
+             */
+            static double percentile(const uint64_t *words, double p)
+            {
+                uint64_t n = words[0];
+                if (n == 0)
+                {
+                    return 0;
+                }
+                const uint64_t *h = words + 3;
+                double target = p * n, acc = 0;
+                for (unsigned b = 0; b < NBUCKETS; b++)
+                {
+                    if (h[b] == 0)
+                    {
+                        continue;
+                    }
+                    if (acc + h[b] >= target)
+                    {
+                        double lo = b == 0 ? 0 : (double)(1ull << b);
+                        double hi = (double)(2ull << b);
+                        double est = lo + (hi - lo) * (target - acc) / h[b];
+                        return est < (double)words[2] ? est : (double)words[2];
+                    }
+                    acc += h[b];
+                }
+                return (double)words[2];
+            }
+        };
+
+        /**
+         * layout of the OP_STATS answer: NSTATHEAD words (queueDepth,
+         * maxQueueDepth, nBatches, nBatched, nErrors, nBusy, nDropped),
+         * one serialized LatencyCounter per endpoint (see Op), then
+         * NCACHEWORDS words of QueryCache counters (all zeros without a cache)
+         */
+        const unsigned NSTATHEAD = 7;
+        const unsigned NCACHEWORDS = 5;
+        const unsigned NSTATWORDS = NSTATHEAD + OP_NUM * LatencyCounter::NWORDS + NCACHEWORDS;
+
+        inline void printStats(const std::vector<uint64_t> &words, std::ostream &out)
+        {
+            if (words.size() < NSTATWORDS)
+            {
+                out << "Malformed stats!\n";
+                return;
+            }
+            out << "queue depth ......................... " << words[0] << " (max " << words[1] << ")\n";
+            out << "batches ............................. " << words[2];
+            out << " (avg size " << (words[2] > 0 ? 1.0 * words[3] / words[2] : 0.0) << ")\n";
+            out << "bad requests ........................ " << words[4] << "\n";
+            out << "busy/dropped requests ............... " << words[5] << "/" << words[6] << "\n";
+            out << "endpoint,count,avg_us,p50_us,p99_us,p999_us,max_us\n";
+            for (unsigned op = 0; op < OP_NUM; op++)
+            {
+                const uint64_t *c = words.data() + NSTATHEAD + op * LatencyCounter::NWORDS;
+                out << opName(op) << "," << c[0] << "," << (c[0] > 0 ? 1.0 * c[1] / c[0] : 0.0);
+                out << "," << LatencyCounter::percentile(c, 0.5);
+                out << "," << LatencyCounter::percentile(c, 0.99);
+                out << "," << LatencyCounter::percentile(c, 0.999);
+                out << "," << c[2] << "\n";
+            }
+            const uint64_t *c = words.data() + NSTATHEAD + OP_NUM * LatencyCounter::NWORDS;
+            if (c[0] + c[1] + c[2] > 0)
+            {
+                out << "cache hits/nears/misses .............. " << c[0] << "/" << c[1] << "/" << c[2];
+                out << " (hit rate " << 1.0 * c[0] / (c[0] + c[1] + c[2]) << ")\n";
+                out << "cache evicted/rejected ............... " << c[3] << "/" << c[4] << "\n";
+            }
+        }
+    }
+}
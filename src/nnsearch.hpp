@@ -2,7 +2,11 @@
 
 #include "iomanager.hpp"
 #include "metrics.hpp"
+#include "compactgraph.hpp"
+#include "eftable.hpp"
 #include <queue>
+#include <atomic>
+#include <algorithm>
 #include <assert.h>
 #include <vector>
 #include <string>
@@ -16,6 +20,26 @@
 
 namespace cmmlab
 {
+    /**
+     * Per-thread working memory of one search. NNSearch keeps one for
+     * the single-threaded API, concurrent callers (e.g. NNServer workers)
+     * should each hold their own one.
+     */
+    struct SearchScratch
+    {
+        vector<unsigned char> flag; // to indicate whether a node has been visited
+        vector<unsigned> visited;
+        vector<unsigned> nbBuf; // decoded neighbors, when the graph is compact
+
+        SearchScratch() {}
+        SearchScratch(size_t nRow) : flag(nRow + 1, 0) {}
+    };
+
+    /**
+     * Metric: L2Metric, IPMetric or CosineMetric (see metrics.hpp)
+     * DIM: the dimension, for the fixed-size kernels of metrics.hpp; 0 for any
+     */
+    template <class Metric = L2Metric, size_t DIM = 0>
     class NNSearch
     {
         using PriorityQType =
@@ -23,23 +47,166 @@ namespace cmmlab
 
     private:
         std::vector<std::vector<unsigned>> nnGraph;
+        CompactGraph cGraph;            // used instead of 'nnGraph' when 'compact' is on
+        std::vector<unsigned> origId;   // internal id -> id in the input files, after reordering
+        std::vector<unsigned> intId;    // id in the input files -> internal id, after reordering
+        bool compact{false};
         float *vectDat{nullptr};
+        std::vector<float> vectAux;     // Metric::aux() of each vector, if Metric::NEEDS_AUX
         size_t nDim{0}, nRow{0};
-        vector<unsigned char> flag; // to indicate whether a node has been visited
+        SearchScratch scratch;
+        EfTable efTable;                // tuned operating points, see nnSearchRecall()
 
     public:
 
-        NNSearch(std::string graphFn, string vectFn)
+        /**
+         * compact = true keeps the graph delta/varint coded (CompactGraph),
+         * with node ids BFS-reordered for locality. The vectors are permuted
+         * accordingly, and the returned ids are mapped back to the input ids.
+         */
+        NNSearch(std::string graphFn, string vectFn, bool compact = false)
         {
-            this->nnGraph = IOManager::loadIVECS(graphFn);
-            assert(nnGraph.size() > 0);
+            this->compact = compact;
             this->vectDat = IOManager::loadFVECSPtr(vectFn, this->nRow, this->nDim);
             std::cout << "Data Size ............................. " << this->nRow << "x" << this->nDim << std::endl;
-            std::cout << this->nnGraph.size() << std::endl;
-            this->flag.resize(this->nRow + 1, 0);
+            if (DIM > 0 && this->nDim != DIM)
+            {
+                std::cerr << "Data of dimension " << this->nDim << " given to a search specialized for " << DIM << "!\n";
+                exit(0);
+            }
+            if (Metric::NEEDS_AUX)
+            {
+                loadAux(IOManager::normsPathFor(graphFn));
+            }
+            if (compact)
+            {
+                this->cGraph.loadIVECS(graphFn);
+                assert(cGraph.size() == this->nRow);
+                reorderByBFS();
+                std::cout << "Graph Size (compact) .................. " << this->cGraph.size();
+                std::cout << ", " << this->cGraph.memoryBytes() / (1024.0 * 1024.0) << " MB" << std::endl;
+            }
+            else
+            {
+                this->nnGraph = IOManager::loadIVECS(graphFn);
+                assert(nnGraph.size() > 0);
+                std::cout << this->nnGraph.size() << std::endl;
+            }
+            this->scratch = makeScratch();
+            this->efTable.setMode(Metric::name(), compact);
+            if (this->efTable.load(EfTable::pathFor(graphFn)))
+            {
+                std::cout << "Efrange table ......................... " << this->efTable.getEntries().size() << " entries" << std::endl;
+                if (this->efTable.skipped() > 0)
+                {
+                    std::cerr << this->efTable.skipped() << " entries of '" << EfTable::pathFor(graphFn) << "' do not match "
+                              << Metric::name() << (compact ? " (compact)" : " (not compact)") << ", ignored!\n";
+                }
+            }
+        }
+
+        size_t getDim() const
+        {
+            return this->nDim;
+        }
+
+        size_t getSize() const
+        {
+            return this->nRow;
+        }
+
+        EfTable &getEfTable()
+        {
+            return this->efTable;
         }
 
-        inline size_t randomUint64(size_t x)
+        /**
+         * efrange of the tuned operating point for (topk, targetRecall),
+         * see EfTable::lookup(). When no tuned point reaches the target,
+         * a warning is printed (once) and the largest efrange tuned for
+         * topk is taken, or 4 x topk for an untuned topk
+         */
+        size_t efrangeFor(size_t topk, float targetRecall) const
+        {
+            size_t efrange = this->efTable.lookup(topk, targetRecall);
+            if (efrange > 0)
+            {
+                return efrange;
+            }
+            static std::atomic<bool> warned(false);
+            if (!warned.exchange(true))
+            {
+                std::cerr << "No tuned efrange reaches recall " << targetRecall << "@" << topk
+                          << ", the recall target is not guaranteed!" << std::endl;
+            }
+            efrange = this->efTable.largest(topk);
+            return efrange > 0 ? efrange : 4 * topk;
+        }
+
+        SearchScratch makeScratch() const
+        {
+            SearchScratch scr(this->nRow);
+            scr.nbBuf.resize(this->cGraph.maxDegree() + 4);
+            return scr;
+        }
+
+    private:
+        inline float dist(const float *query, float qAux, size_t idx) const
+        {
+            return Metric::template dist<DIM>(query, this->vectDat + idx * this->nDim, this->nDim,
+                                              qAux, Metric::NEEDS_AUX ? this->vectAux[idx] : 0.0f);
+        }
+
+        // the values stored at index build, or computed here if there are none
+        void loadAux(std::string normsFn)
+        {
+            ifstream inStrm(normsFn, ios::binary);
+            if (inStrm.is_open())
+            {
+                inStrm.close();
+                std::vector<std::vector<float>> rows = IOManager::loadFVECS(normsFn);
+                if (rows.size() == 1 && rows[0].size() == this->nRow)
+                {
+                    this->vectAux.swap(rows[0]);
+                    return;
+                }
+                std::cerr << "File '" << normsFn << "' does not match the data, ignored!\n";
+            }
+            this->vectAux.resize(this->nRow);
+            for (size_t i = 0; i < this->nRow; i++)
+            {
+                this->vectAux[i] = Metric::aux(this->vectDat + i * this->nDim, this->nDim);
+            }
+        }
+
+        void reorderByBFS()
+        {
+            std::vector<unsigned> newId = this->cGraph.bfsOrder();
+            this->cGraph.reorder(newId);
+            this->intId = newId;
+            this->origId.resize(this->nRow);
+            float *permDat = new float[this->nRow * this->nDim];
+            for (size_t i = 0; i < this->nRow; i++)
+            {
+                this->origId[newId[i]] = i;
+                memcpy(permDat + newId[i] * this->nDim, this->vectDat + i * this->nDim, this->nDim * sizeof(float));
+            }
+            delete[] this->vectDat;
+            this->vectDat = permDat;
+            if (!this->vectAux.empty())
+            {
+                std::vector<float> permAux(this->nRow);
+                for (size_t i = 0; i < this->nRow; i++)
+                {
+                    permAux[newId[i]] = this->vectAux[i];
+                }
+                this->vectAux.swap(permAux);
+            }
+        }
+
+    public:
+
+        inline size_t randomUint64(size_t x) const
         {
             x ^= x >> 12; // a
             x ^= x << 25; // b
@@ -48,57 +215,128 @@ namespace cmmlab
         }
 
         std::vector<unsigned> nnSearch(float *query, size_t topk, size_t efrange)
+        {
+            return nnSearch(query, topk, efrange, this->scratch);
+        }
+
+        /**
+         * thread-safe as long as each thread passes its own 'scratch'.
+         * 'seeds' (ids as in the input files, e.g. the answer to a
+         * near-duplicate query) replace the random seeds if given.
+         */
+        std::vector<unsigned> nnSearch(float *query, size_t topk, size_t efrange, SearchScratch &scratch,
+                                       const std::vector<unsigned> *seeds = nullptr) const
         {
             unsigned currObj = 1;
             float curdist = RAND_MAX;
+            float qAux = Metric::aux(query, this->nDim);
             PriorityQType candidate_set, topkRank;
-            memset(flag.data(), 0, this->nRow+1);
-            vector<unsigned> visited;
+            vector<unsigned char> &flag = scratch.flag;
+            vector<unsigned> &visited = scratch.visited;
+            if (flag.size() < this->nRow + 1)
+            {
+                flag.assign(this->nRow + 1, 0);
+            }
+            if (compact && scratch.nbBuf.size() < this->cGraph.maxDegree() + 4)
+            {
+                scratch.nbBuf.resize(this->cGraph.maxDegree() + 4);
+            }
+            visited.clear();
             vector<unsigned> knn;
+            // the search keeps the 'ef' best nodes found so far, and returns the top-k of them
+            size_t ef = std::max(topk, efrange);
 
-            //find out the best seed from 32 random points
-            for (size_t i = 0; i < 32; i++)
+            if (seeds != nullptr && !seeds->empty())
             {
-                unsigned idx = randomUint64(i) % this->nRow; 
-
-                if (flag[idx] == 1)
+                //warm start: all the seeds enter the candidate set
+                for (unsigned sd : *seeds)
                 {
-                    continue;
+                    unsigned idx = intId.empty() ? sd : (sd < intId.size() ? intId[sd] : this->nRow);
+                    if (idx >= this->nRow || flag[idx] == 1)
+                    {
+                        continue;
+                    }
+                    float tmpdist = dist(query, qAux, idx);
+                    flag[idx] = 1;
+                    visited.emplace_back(idx);
+                    candidate_set.emplace(-tmpdist, idx);
+                    topkRank.emplace(tmpdist, idx);
+                    if (topkRank.size() > ef)
+                    {
+                        topkRank.pop();
+                    }
+                    if (tmpdist < curdist)
+                    {
+                        curdist = tmpdist;
+                        currObj = idx;
+                    }
                 }
+            }
+            if (candidate_set.empty())
+            {
+                //find out the best seed from 32 random points
+                for (size_t i = 0; i < 32; i++)
+                {
+                    unsigned idx = randomUint64(i) % this->nRow; 
+
+                    if (flag[idx] == 1)
+                    {
+                        continue;
+                    }
                 
-                float tmpdist = Metrics::l2dst(query, this->vectDat + idx * this->nDim, this->nDim);
-                flag[idx] = 1;
+                    float tmpdist = dist(query, qAux, idx);
+                    flag[idx] = 1;
 
-                if (tmpdist < curdist)
-                {
-                    curdist = tmpdist;
-                    currObj = idx;
+                    if (tmpdist < curdist)
+                    {
+                        curdist = tmpdist;
+                        currObj = idx;
+                    }
+                    visited.emplace_back(idx);
                 }
-                visited.emplace_back(idx);
-            }
 
+                topkRank.emplace(curdist, currObj);
+                candidate_set.emplace(-curdist, currObj);
+            }
             float lowerBound = curdist;
-            topkRank.emplace(curdist, currObj);
-            candidate_set.emplace(-curdist, currObj);
 
             //perform NN-Descent on the graph, starting from the selected seed
             while (!candidate_set.empty())
             {
                 std::pair<float, unsigned> current_node_pair = candidate_set.top();
-                candidate_set.pop();
-
                 unsigned current_node = current_node_pair.second;
                 float current_dist = -current_node_pair.first; // 注意：这里取负值是因为优先队列是最大堆
 
+                // the closest candidate cannot improve the 'ef' best ones any more
+                if (topkRank.size() >= ef && current_dist > topkRank.top().first)
+                {
+                    break;
+                }
+                candidate_set.pop();
+
+                const unsigned *nbs = nullptr;
+                unsigned nbn = 0;
+                if (compact)
+                {
+                    nbn = cGraph.decode(current_node, scratch.nbBuf.data());
+                    nbs = scratch.nbBuf.data();
+                }
+                else
+                {
+                    nbn = nnGraph[current_node].size();
+                    nbs = nnGraph[current_node].data();
+                }
+
                 // 遍历当前节点的所有邻居
-                for (unsigned neighbor : nnGraph[current_node])
+                for (unsigned j = 0; j < nbn; j++)
                 {
+                    unsigned neighbor = nbs[j];
                     if (flag[neighbor] == 1)
                     {
                         continue; // 如果邻居已经被访问过，跳过
                     }
 
-                    float neighbor_dist = Metrics::l2dst(query, this->vectDat + neighbor * this->nDim, this->nDim);
+                    float neighbor_dist = dist(query, qAux, neighbor);
                     flag[neighbor] = 1;
                     visited.emplace_back(neighbor);
 
@@ -108,13 +346,12 @@ namespace cmmlab
                         lowerBound = neighbor_dist;
                     }
 
-                    candidate_set.emplace(-neighbor_dist, neighbor); // 注意：这里取负值是因为优先队列是最大堆
-
-                    // 如果邻居的距离小于当前最远的 topk 邻居的距离，加入 topk 排序队列
-                    if (topkRank.size() < topk || neighbor_dist < topkRank.top().first)
+                    // 如果邻居的距离小于当前最远的 ef 邻居的距离，加入候选集与排序队列
+                    if (topkRank.size() < ef || neighbor_dist < topkRank.top().first)
                     {
+                        candidate_set.emplace(-neighbor_dist, neighbor); // 注意：这里取负值是因为优先队列是最大堆
                         topkRank.emplace(neighbor_dist, neighbor);
-                        if (topkRank.size() > topk)
+                        if (topkRank.size() > ef)
                         {
                             topkRank.pop();
                         }
@@ -130,6 +367,10 @@ namespace cmmlab
                flag[*vit] = 0; // 重置访问标志
             }
             visited.clear();
+            while (topkRank.size() > topk)
+            {
+                topkRank.pop();
+            }
             int i = topkRank.size();
             knn.resize(topkRank.size());
             //collect the found nearest neigbors, ranked in ascending order
@@ -139,7 +380,54 @@ namespace cmmlab
                 knn[i] = topkRank.top().second;
                 topkRank.pop();
             }
+            if (!origId.empty())
+            {
+                for (auto &id : knn)
+                {
+                    id = origId[id];
+                }
+            }
+
+            return knn;
+        }
+
+        std::vector<unsigned> nnSearchRecall(float *query, size_t topk, float targetRecall)
+        {
+            return nnSearch(query, topk, efrangeFor(topk, targetRecall), this->scratch);
+        }
+
+        std::vector<unsigned> nnSearchRecall(float *query, size_t topk, float targetRecall, SearchScratch &scratch) const
+        {
+            return nnSearch(query, topk, efrangeFor(topk, targetRecall), scratch);
+        }
 
+        /**
+         * brute-force top-k, as ids of the input files; used to build the
+         * ground truth of a query sample when none is given
+         */
+        std::vector<unsigned> exactSearch(const float *query, size_t topk) const
+        {
+            PriorityQType topkRank;
+            float qAux = Metric::aux(query, this->nDim);
+            for (size_t i = 0; i < this->nRow; i++)
+            {
+                float d = dist(query, qAux, i);
+                if (topkRank.size() < topk || d < topkRank.top().first)
+                {
+                    topkRank.emplace(d, i);
+                    if (topkRank.size() > topk)
+                    {
+                        topkRank.pop();
+                    }
+                }
+            }
+            std::vector<unsigned> knn(topkRank.size());
+            for (size_t i = knn.size(); i > 0; i--)
+            {
+                unsigned id = topkRank.top().second;
+                knn[i - 1] = origId.empty() ? id : origId[id];
+                topkRank.pop();
+            }
             return knn;
         }
 
@@ -151,6 +439,29 @@ namespace cmmlab
                 vectDat = nullptr;
             }
             this->nnGraph.clear();
+            this->cGraph.clear();
         }
     };
+
+    /**
+     * runs 'fn.template run<DIM>()' with DIM the dimension 'dim' when it
+     * is one of the common ones (see the kernels in metrics.hpp), and with
+     * DIM = 0 otherwise. 'fn' is a functor with a
+     * 'template <size_t DIM> R run()' member, whose R is returned.
+     */
+    template <class Fn>
+    auto dispatchDim(size_t dim, const Fn &fn) -> decltype(fn.template run<0>())
+    {
+        switch (dim)
+        {
+        case 96:
+            return fn.template run<96>();
+        case 128:
+            return fn.template run<128>();
+        case 768:
+            return fn.template run<768>();
+        default:
+            return fn.template run<0>();
+        }
+    }
 }
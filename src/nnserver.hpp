@@ -0,0 +1,495 @@
+#pragma once
+
+#include "nnsearch.hpp"
+#include "nnproto.hpp"
+#include "querycache.hpp"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <vector>
+#include <string>
+
+/***
+ * @brief A long-running query server on top of NNSearch. The index is
+ * opened once by the caller, and queries come in over a Unix domain
+ * socket or a local TCP port with the binary protocol in nnproto.hpp.
+ *
+ * 1. one reader thread per connection decodes requests and puts them
+ *    into a shared queue, so a client may pipeline many requests
+ * 2. a fixed pool of workers takes up to 'maxBatch' requests at a time
+ *    (waiting at most 'batchWaitUs' for a batch to fill up), searches
+ *    them with its own SearchScratch, and sends the answers back with
+ *    one write per connection per batch
+ * 3. per-endpoint latency (from request decoded to answer sent) and
+ *    queue-depth counters are kept, and served by OP_STATS
+ * 4. with a QueryCache set, cache hits are answered right away by the
+ *    reader, and near-duplicate hits are searched from cached seeds
+ * 5. the queue holds at most 'maxQueue' requests, beyond which new ones
+ *    are answered ST_BUSY at once. Requests of a connection that has
+ *    been closed (or whose client stopped reading for SEND_TIMEOUT_S)
+ *    are dropped, and so is the whole queue on stop; hence a client
+ *    must not shut down its write side before it has all its answers
+ *
+ * @copyright All rights are reserved by the author
+ */
+
+namespace cmmlab
+{
+    template <class Search = NNSearch<>>
+    class NNServer
+    {
+        struct Connection
+        {
+            int fd;
+            std::mutex wrLock;
+            std::atomic<bool> dead{false}; // closed by the client, or a write failed
+
+            Connection(int fd0) : fd(fd0) {}
+            ~Connection()
+            {
+                ::close(fd);
+            }
+        };
+
+        struct Request
+        {
+            std::shared_ptr<Connection> conn;
+            nnproto::ReqHeader hdr;
+            std::vector<float> query;
+            std::vector<unsigned> seeds;
+            std::chrono::steady_clock::time_point t0;
+        };
+
+    private:
+        Search &nns;
+        QueryCache *cache{nullptr};
+        size_t nThreads, maxBatch, batchWaitUs, maxQueue;
+        int listenFd{-1};
+        std::string unixPath;
+        std::atomic<bool> running{false};
+        const volatile sig_atomic_t *stopFlag{nullptr};
+
+        std::mutex qLock;
+        std::condition_variable qCond;
+        std::deque<Request> queue;
+        std::vector<std::thread> workers;
+
+        struct Reader
+        {
+            std::thread thrd;
+            std::weak_ptr<Connection> conn;
+            std::shared_ptr<std::atomic<bool>> done;
+        };
+
+        std::vector<Reader> readers;
+
+        nnproto::LatencyCounter latency[nnproto::OP_NUM];
+        std::atomic<uint64_t> queueDepth{0}, maxQueueDepth{0};
+        std::atomic<uint64_t> nBatches{0}, nBatched{0};
+        std::atomic<uint64_t> nErrors{0}, nBusy{0}, nDropped{0};
+
+    public:
+        static const int SEND_TIMEOUT_S = 5;
+
+        NNServer(Search &nns0, size_t nThreads0, size_t maxBatch0, size_t batchWaitUs0, size_t maxQueue0 = 4096)
+            : nns(nns0), nThreads(nThreads0), maxBatch(maxBatch0), batchWaitUs(batchWaitUs0), maxQueue(maxQueue0)
+        {
+            assert(nThreads > 0 && maxBatch > 0 && maxQueue > 0);
+        }
+
+        // to be called before run(), the cache is not owned
+        void setCache(QueryCache *cache0)
+        {
+            cache = cache0;
+        }
+
+        /**
+         * to be called before run(): run() also stops once '*flag' is
+         * non-zero, so a signal handler only has to set it
+         */
+        void setStopFlag(const volatile sig_atomic_t *flag)
+        {
+            stopFlag = flag;
+        }
+
+        bool listenUnix(const std::string &path)
+        {
+            listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (listenFd < 0)
+            {
+                std::cerr << "Cannot create Unix socket!\n";
+                return false;
+            }
+            sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+            ::unlink(path.c_str());
+            if (::bind(listenFd, (sockaddr *)&addr, sizeof(addr)) < 0 || ::listen(listenFd, 128) < 0)
+            {
+                std::cerr << "Socket '" << path << "' cannot bind for listen!\n";
+                ::close(listenFd);
+                listenFd = -1;
+                return false;
+            }
+            unixPath = path;
+            return true;
+        }
+
+        // only binds the loopback interface, this is not meant to be exposed
+        bool listenTCP(unsigned short port)
+        {
+            listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+            if (listenFd < 0)
+            {
+                std::cerr << "Cannot create TCP socket!\n";
+                return false;
+            }
+            int one = 1;
+            setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            if (::bind(listenFd, (sockaddr *)&addr, sizeof(addr)) < 0 || ::listen(listenFd, 128) < 0)
+            {
+                std::cerr << "Port " << port << " cannot bind for listen!\n";
+                ::close(listenFd);
+                listenFd = -1;
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * accept connections until stop() is called, then drop the
+         * queued requests, join all threads and return
+         */
+        void run()
+        {
+            assert(listenFd >= 0);
+            running = true;
+            for (size_t i = 0; i < nThreads; i++)
+            {
+                workers.emplace_back(&NNServer::workLoop, this);
+            }
+
+            while (running && !(stopFlag != nullptr && *stopFlag))
+            {
+                pollfd pfd;
+                pfd.fd = listenFd;
+                pfd.events = POLLIN;
+                // wake up now and then to notice stop() or the stop flag
+                if (::poll(&pfd, 1, 200) <= 0)
+                {
+                    continue;
+                }
+                int fd = ::accept(listenFd, nullptr, nullptr);
+                if (fd < 0)
+                {
+                    continue;
+                }
+                if (unixPath.empty())
+                {
+                    int one = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                }
+                // a client that stops reading must not hold a worker forever
+                timeval tv = {SEND_TIMEOUT_S, 0};
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+                reapReaders();
+                std::shared_ptr<Connection> conn(new Connection(fd));
+                Reader rd;
+                rd.conn = conn;
+                rd.done = std::make_shared<std::atomic<bool>>(false);
+                rd.thrd = std::thread(&NNServer::readLoop, this, conn, rd.done);
+                readers.push_back(std::move(rd));
+            }
+            {
+                // under the lock, so no worker can miss the notification
+                std::lock_guard<std::mutex> lk(qLock);
+                running = false;
+                nDropped += queue.size();
+                queue.clear();
+                queueDepth = 0;
+            }
+            qCond.notify_all();
+
+            ::close(listenFd);
+            listenFd = -1;
+            if (!unixPath.empty())
+            {
+                ::unlink(unixPath.c_str());
+            }
+            // wakes up readers, and workers blocked on a client not reading
+            for (Reader &rd : readers)
+            {
+                std::shared_ptr<Connection> conn = rd.conn.lock();
+                if (conn)
+                {
+                    conn->dead = true;
+                    ::shutdown(conn->fd, SHUT_RDWR);
+                }
+            }
+            for (Reader &rd : readers)
+            {
+                rd.thrd.join();
+            }
+            for (auto &t : workers)
+            {
+                t.join();
+            }
+            readers.clear();
+            workers.clear();
+        }
+
+        // may be called from any thread (signal handlers use setStopFlag())
+        void stop()
+        {
+            running = false;
+        }
+
+        // see nnproto::printStats() for the layout
+        std::vector<uint64_t> getStats() const
+        {
+            std::vector<uint64_t> words;
+            words.push_back(queueDepth.load());
+            words.push_back(maxQueueDepth.load());
+            words.push_back(nBatches.load());
+            words.push_back(nBatched.load());
+            words.push_back(nErrors.load());
+            words.push_back(nBusy.load());
+            words.push_back(nDropped.load());
+            for (unsigned op = 0; op < nnproto::OP_NUM; op++)
+            {
+                latency[op].serialize(words);
+            }
+            if (cache != nullptr)
+            {
+                cache->getStats(words);
+            }
+            else
+            {
+                words.resize(words.size() + nnproto::NCACHEWORDS, 0);
+            }
+            return words;
+        }
+
+    private:
+        static uint64_t elapsedUs(std::chrono::steady_clock::time_point t0)
+        {
+            auto t1 = std::chrono::steady_clock::now();
+            return std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count();
+        }
+
+        /**
+         * to be called under conn.wrLock; a failed (or timed out) write
+         * leaves the stream cut in the middle, so the connection is given up
+         */
+        bool send(Connection &conn, const void *buf, size_t n)
+        {
+            if (conn.dead || !nnproto::writeFull(conn.fd, buf, n))
+            {
+                conn.dead = true;
+                ::shutdown(conn.fd, SHUT_RDWR);
+                return false;
+            }
+            return true;
+        }
+
+        void sendError(Connection &conn, uint32_t reqId, uint32_t status)
+        {
+            nnproto::RspHeader rsp = {reqId, status, 0};
+            std::lock_guard<std::mutex> lk(conn.wrLock);
+            send(conn, &rsp, sizeof(rsp));
+            if (status == nnproto::ST_BUSY)
+                nBusy++;
+            else
+                nErrors++;
+        }
+
+        // join the readers of connections that have been closed
+        void reapReaders()
+        {
+            size_t j = 0;
+            for (size_t i = 0; i < readers.size(); i++)
+            {
+                if (*readers[i].done)
+                {
+                    readers[i].thrd.join();
+                }
+                else if (i != j++)
+                {
+                    readers[j - 1] = std::move(readers[i]);
+                }
+            }
+            readers.resize(j);
+        }
+
+        void readLoop(std::shared_ptr<Connection> conn, std::shared_ptr<std::atomic<bool>> done)
+        {
+            nnproto::ReqHeader hdr;
+            while (nnproto::readFull(conn->fd, &hdr, sizeof(hdr)))
+            {
+                auto t0 = std::chrono::steady_clock::now();
+                if (hdr.magic != nnproto::MAGIC || hdr.op >= nnproto::OP_NUM)
+                {
+                    sendError(*conn, hdr.reqId, nnproto::ST_BAD_REQUEST);
+                    break; // the stream cannot be re-synchronized
+                }
+                // the payload size comes from 'dim': check it before reading
+                // anything, since a bad one leaves the stream out of sync
+                size_t expDim = hdr.op == nnproto::OP_STATS ? 0 : nns.getDim();
+                if (hdr.dim != expDim)
+                {
+                    sendError(*conn, hdr.reqId, nnproto::ST_BAD_DIM);
+                    break;
+                }
+                if (hdr.op == nnproto::OP_STATS)
+                {
+                    std::vector<uint64_t> words = getStats();
+                    nnproto::RspHeader rsp = {hdr.reqId, nnproto::ST_OK, (uint32_t)words.size()};
+                    std::lock_guard<std::mutex> lk(conn->wrLock);
+                    send(*conn, &rsp, sizeof(rsp)) && send(*conn, words.data(), words.size() * sizeof(uint64_t));
+                    latency[nnproto::OP_STATS].record(elapsedUs(t0));
+                    continue;
+                }
+
+                Request req;
+                req.hdr = hdr;
+                req.query.resize(hdr.dim);
+                if (!nnproto::readFull(conn->fd, req.query.data(), hdr.dim * sizeof(float)))
+                {
+                    break;
+                }
+                if (hdr.topk == 0 || hdr.topk > nns.getSize())
+                {
+                    sendError(*conn, hdr.reqId, nnproto::ST_BAD_REQUEST);
+                    continue;
+                }
+                if (cache != nullptr)
+                {
+                    QueryCache::Result r = cache->lookup(req.query.data(), hdr.topk, hdr.efrange, req.seeds);
+                    if (r == QueryCache::HIT)
+                    {
+                        nnproto::RspHeader rsp = {hdr.reqId, nnproto::ST_OK, (uint32_t)req.seeds.size()};
+                        {
+                            std::lock_guard<std::mutex> lk(conn->wrLock);
+                            send(*conn, &rsp, sizeof(rsp)) && send(*conn, req.seeds.data(), req.seeds.size() * sizeof(unsigned));
+                        }
+                        latency[nnproto::OP_SEARCH].record(elapsedUs(t0));
+                        continue;
+                    }
+                }
+                req.conn = conn;
+                req.t0 = t0;
+                {
+                    std::unique_lock<std::mutex> lk(qLock);
+                    if (!running)
+                    {
+                        break;
+                    }
+                    if (queue.size() >= maxQueue)
+                    {
+                        lk.unlock();
+                        sendError(*conn, hdr.reqId, nnproto::ST_BUSY);
+                        continue;
+                    }
+                    queue.push_back(std::move(req));
+                    uint64_t depth = queue.size();
+                    queueDepth = depth;
+                    if (depth > maxQueueDepth)
+                    {
+                        maxQueueDepth = depth;
+                    }
+                }
+                qCond.notify_one();
+            }
+            // what is still queued for this connection has nobody to go to
+            conn->dead = true;
+            *done = true;
+        }
+
+        void workLoop()
+        {
+            SearchScratch scratch = nns.makeScratch();
+            std::vector<Request> batch;
+            std::map<Connection *, std::vector<uint32_t>> replies;
+
+            while (true)
+            {
+                batch.clear();
+                {
+                    std::unique_lock<std::mutex> lk(qLock);
+                    qCond.wait(lk, [this] { return !queue.empty() || !running; });
+                    if (queue.empty())
+                    {
+                        return; // stopped and drained
+                    }
+                    if (queue.size() < maxBatch && batchWaitUs > 0)
+                    {
+                        qCond.wait_for(lk, std::chrono::microseconds(batchWaitUs),
+                                       [this] { return queue.size() >= maxBatch || !running; });
+                    }
+                    while (!queue.empty() && batch.size() < maxBatch)
+                    {
+                        batch.push_back(std::move(queue.front()));
+                        queue.pop_front();
+                    }
+                    queueDepth = queue.size();
+                }
+                nBatches++;
+                nBatched += batch.size();
+
+                // answers to the same connection are coalesced into one write
+                replies.clear();
+                for (Request &req : batch)
+                {
+                    if (req.conn->dead)
+                    {
+                        nDropped++;
+                        continue;
+                    }
+                    std::vector<unsigned> knn = nns.nnSearch(req.query.data(), req.hdr.topk, req.hdr.efrange, scratch,
+                                                             req.seeds.empty() ? nullptr : &req.seeds);
+                    if (cache != nullptr)
+                    {
+                        cache->insert(req.query.data(), req.hdr.topk, req.hdr.efrange, knn);
+                    }
+                    std::vector<uint32_t> &buf = replies[req.conn.get()];
+                    buf.push_back(req.hdr.reqId);
+                    buf.push_back(nnproto::ST_OK);
+                    buf.push_back((uint32_t)knn.size());
+                    buf.insert(buf.end(), knn.begin(), knn.end());
+                }
+                for (Request &req : batch)
+                {
+                    auto it = replies.find(req.conn.get());
+                    if (it != replies.end())
+                    {
+                        std::lock_guard<std::mutex> lk(req.conn->wrLock);
+                        send(*req.conn, it->second.data(), it->second.size() * sizeof(uint32_t));
+                        replies.erase(it);
+                    }
+                }
+                for (Request &req : batch)
+                {
+                    if (!req.conn->dead)
+                    {
+                        latency[nnproto::OP_SEARCH].record(elapsedUs(req.t0));
+                    }
+                }
+            }
+        }
+    };
+}
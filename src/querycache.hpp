@@ -0,0 +1,314 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include <random>
+#include <atomic>
+#include <mutex>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include <string>
+
+#include "metrics.hpp"
+
+/***
+ * @brief A bounded, thread-safe cache of search results, for traffic
+ * where the same query embedding is issued again and again (retries,
+ * pagination, ...).
+ *
+ * A query has two keys:
+ * 1. the fine key hashes its components quantized on a grid relative to
+ *    the query norm (the norm itself quantized on a log scale), mixed
+ *    with (topk, efrange): a hit returns the cached ids, without any
+ *    search
+ * 2. the coarse key is the signs of 'coarseBits' fixed random
+ *    projections of the query (SimHash): two queries at an angle theta
+ *    get the same key with probability (1 - theta / pi)^coarseBits,
+ *    whatever the dimension. A hit only tells that a query in about the
+ *    same direction has been answered, and its ids are handed out as
+ *    seeds to warm-start the traversal (see NNSearch::nnSearch())
+ *
+ * The cache is split into shards, each one under its own lock, with
+ * LRU eviction and TinyLFU admission: when a shard is full, a new entry
+ * only gets in if it has been asked for more often than the LRU victim,
+ * according to a count-min sketch of recent lookups that is halved from
+ * time to time. The capacity is split over the shards as evenly as
+ * possible, so the total never exceeds it (below NSHARDS entries, some
+ * shards do not cache at all).
+ *
+ * @copyright All rights are reserved by the author
+ */
+
+namespace cmmlab
+{
+    class QueryCache
+    {
+    public:
+        enum Result
+        {
+            MISS = 0,
+            HIT = 1,
+            NEAR = 2
+        };
+
+        static const unsigned NSHARDS = 16;
+
+    private:
+        struct Entry
+        {
+            uint64_t key;
+            std::vector<unsigned> ids;
+        };
+
+        // count-min sketch of 4 rows, saturating at 15 like the 4-bit original
+        struct FreqSketch
+        {
+            std::vector<uint8_t> cnt;
+            size_t width{1}, nAdded{0}, sampleSize{1};
+
+            void init(size_t capacity)
+            {
+                width = 1;
+                while (width < 4 * capacity)
+                {
+                    width <<= 1;
+                }
+                cnt.assign(4 * width, 0);
+                sampleSize = 10 * capacity;
+                nAdded = 0;
+            }
+
+            static uint64_t rowHash(uint64_t key, unsigned row)
+            {
+                return mix(key + 0x9e3779b97f4a7c15ull * (row + 1));
+            }
+
+            void add(uint64_t key)
+            {
+                for (unsigned r = 0; r < 4; r++)
+                {
+                    uint8_t &c = cnt[r * width + (rowHash(key, r) & (width - 1))];
+                    if (c < 15)
+                    {
+                        c++;
+                    }
+                }
+                if (++nAdded >= sampleSize)
+                {
+                    // aging, so that old popularity fades away
+                    for (auto &c : cnt)
+                    {
+                        c >>= 1;
+                    }
+                    nAdded /= 2;
+                }
+            }
+
+            unsigned estimate(uint64_t key) const
+            {
+                unsigned f = 15;
+                for (unsigned r = 0; r < 4; r++)
+                {
+                    f = std::min<unsigned>(f, cnt[r * width + (rowHash(key, r) & (width - 1))]);
+                }
+                return f;
+            }
+        };
+
+        struct Shard
+        {
+            std::mutex lock;
+            std::list<Entry> lru; // most recently used first
+            std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+            std::unordered_map<uint64_t, std::vector<unsigned>> coarseIndex; // coarse key -> seeds
+            FreqSketch sketch;
+            size_t capacity{0};
+        };
+
+        Shard shards[NSHARDS];
+        size_t dim;
+        float fineStep;
+        unsigned coarseBits;
+        std::vector<float> proj; // coarseBits x dim, N(0, 1)
+
+        std::atomic<uint64_t> nHits{0}, nNears{0}, nMisses{0};
+        std::atomic<uint64_t> nEvicted{0}, nRejected{0};
+
+    public:
+        /**
+         * capacity: max. number of cached results, over all shards
+         * dim: dimension of the queries
+         * fineStep: quantization step of the fine key, relative to the query norm
+         * coarseBits: number of projections of the coarse key (at most 64)
+         */
+        QueryCache(size_t capacity, size_t dim, float fineStep = 1e-4f, unsigned coarseBits = 24)
+            : dim(dim), fineStep(fineStep), coarseBits(std::min(coarseBits, 64u))
+        {
+            for (unsigned i = 0; i < NSHARDS; i++)
+            {
+                shards[i].capacity = capacity / NSHARDS + (i < capacity % NSHARDS ? 1 : 0);
+                shards[i].sketch.init(std::max<size_t>(1, shards[i].capacity));
+            }
+            // fixed seed, so that keys do not change from run to run
+            std::mt19937 rng(20241210);
+            std::normal_distribution<float> gauss(0, 1);
+            proj.resize(this->coarseBits * dim);
+            for (float &x : proj)
+            {
+                x = gauss(rng);
+            }
+        }
+
+        static inline uint64_t mix(uint64_t x)
+        {
+            x ^= x >> 33;
+            x *= 0xff51afd7ed558ccdull;
+            x ^= x >> 33;
+            x *= 0xc4ceb9fe1a85ec53ull;
+            x ^= x >> 33;
+            return x;
+        }
+
+        static uint64_t quantHash(const float *query, size_t dim, float step)
+        {
+            double norm = 0;
+            for (size_t i = 0; i < dim; i++)
+            {
+                norm += (double)query[i] * query[i];
+            }
+            norm = sqrt(norm);
+            uint64_t h = mix((uint64_t)(int64_t)llround(log(norm + 1e-30) / log1p(step)));
+            double scale = norm > 0 ? 1.0 / (norm * step) : 0;
+            for (size_t i = 0; i < dim; i++)
+            {
+                h = mix(h ^ (uint64_t)(int64_t)llround(query[i] * scale)) + i;
+            }
+            return h;
+        }
+
+        uint64_t coarseKey(const float *query) const
+        {
+            uint64_t bits = 0;
+            for (unsigned b = 0; b < coarseBits; b++)
+            {
+                if (dotprod<0>(proj.data() + b * dim, query, dim) > 0)
+                {
+                    bits |= 1ull << b;
+                }
+            }
+            return mix(bits);
+        }
+
+        /**
+         * on HIT 'ids' gets the cached answer, on NEAR the answer of a
+         * near-duplicate query (to be used as seeds), on MISS it is cleared
+         */
+        Result lookup(const float *query, size_t topk, size_t efrange, std::vector<unsigned> &ids)
+        {
+            uint64_t key = fineKey(query, topk, efrange);
+            Shard &sh = shards[key % NSHARDS];
+            {
+                std::lock_guard<std::mutex> lk(sh.lock);
+                sh.sketch.add(key);
+                auto it = sh.index.find(key);
+                if (it != sh.index.end())
+                {
+                    sh.lru.splice(sh.lru.begin(), sh.lru, it->second);
+                    ids = it->second->ids;
+                    nHits++;
+                    return HIT;
+                }
+            }
+
+            // near-duplicates may live in any shard, the coarse key picks it
+            uint64_t ckey = coarseKey(query);
+            Shard &csh = shards[ckey % NSHARDS];
+            {
+                std::lock_guard<std::mutex> lk(csh.lock);
+                auto cit = csh.coarseIndex.find(ckey);
+                if (cit != csh.coarseIndex.end())
+                {
+                    ids = cit->second;
+                    nNears++;
+                    return NEAR;
+                }
+            }
+            ids.clear();
+            nMisses++;
+            return MISS;
+        }
+
+        void insert(const float *query, size_t topk, size_t efrange, const std::vector<unsigned> &ids)
+        {
+            uint64_t key = fineKey(query, topk, efrange);
+            uint64_t ckey = coarseKey(query);
+            {
+                Shard &sh = shards[key % NSHARDS];
+                std::lock_guard<std::mutex> lk(sh.lock);
+                auto it = sh.index.find(key);
+                if (sh.capacity == 0)
+                {
+                    nRejected++;
+                }
+                else if (it != sh.index.end())
+                {
+                    it->second->ids = ids;
+                    sh.lru.splice(sh.lru.begin(), sh.lru, it->second);
+                }
+                else if (sh.lru.size() >= sh.capacity &&
+                         sh.sketch.estimate(key) <= sh.sketch.estimate(sh.lru.back().key))
+                {
+                    nRejected++; // the seeds below are still worth keeping
+                }
+                else
+                {
+                    if (sh.lru.size() >= sh.capacity)
+                    {
+                        sh.index.erase(sh.lru.back().key);
+                        sh.lru.pop_back();
+                        nEvicted++;
+                    }
+                    Entry e;
+                    e.key = key;
+                    e.ids = ids;
+                    sh.lru.push_front(std::move(e));
+                    sh.index[key] = sh.lru.begin();
+                }
+            }
+            // the coarse index keeps its own copy of the ids, bounded by the
+            // same capacity; when full, an arbitrary seed list makes room
+            Shard &csh = shards[ckey % NSHARDS];
+            std::lock_guard<std::mutex> lk(csh.lock);
+            if (csh.capacity == 0)
+            {
+                return;
+            }
+            if (csh.coarseIndex.size() >= csh.capacity && csh.coarseIndex.count(ckey) == 0)
+            {
+                csh.coarseIndex.erase(csh.coarseIndex.begin());
+            }
+            csh.coarseIndex[ckey] = ids;
+        }
+
+        /**
+         * hits, nears, misses, evicted, rejected
+         */
+        void getStats(std::vector<uint64_t> &words) const
+        {
+            words.push_back(nHits.load());
+            words.push_back(nNears.load());
+            words.push_back(nMisses.load());
+            words.push_back(nEvicted.load());
+            words.push_back(nRejected.load());
+        }
+
+    private:
+        uint64_t fineKey(const float *query, size_t topk, size_t efrange) const
+        {
+            uint64_t h = quantHash(query, dim, fineStep);
+            return mix(h ^ mix(((uint64_t)topk << 32) | (uint32_t)efrange));
+        }
+    };
+}
@@ -1,6 +1,7 @@
 
 #include "../src/iomanager.hpp"
 #include "../src/nnsearch.hpp"
+#include "../src/eftuner.hpp"
 #include "graphdiverse.hpp"
 
 #include <iostream>
@@ -20,33 +21,8 @@
 using namespace std;
 using namespace cmmlab;
 
-float getRecall(std::vector<std::vector<unsigned>> &anng, std::vector<std::vector<unsigned>> &knng, size_t checkK)
-{
-    size_t hit = 0;
-    size_t checkN = std::min(anng.size(), knng.size());
-
-    for (size_t i = 0; i < checkN; ++i)
-    {
-        auto &ann = anng[i];
-        auto &knn = knng[i];
-        for (size_t j = 0; j < checkK; ++j)
-        {
-            auto idx = ann[j];
-            for (size_t l = 0; l < checkK; ++l)
-            {
-                auto nb = knn[l];
-                if (idx == nb)
-                {
-                    ++hit;
-                    break;
-                }
-            }
-        }
-    }
-    return 1.0 * hit / (checkK * checkN);
-}
-
-void searchRecall(string datFn, string indexPath, string queryPath, string gtPath)
+template <class Metric, size_t DIM>
+void searchRecall(string datFn, string indexPath, string queryPath, string gtPath, bool compact)
 {
     int RecallK = 10;
     size_t qryRow = 0, qryDim = 0;
@@ -56,7 +32,7 @@ void searchRecall(string datFn, string indexPath, string queryPath, string gtPat
     qryDim = queries[0].size();
     std::vector<std::vector<unsigned>> gt = IOManager::loadIVECS(gtPath);
 
-    NNSearch mynns(indexPath, datFn);
+    NNSearch<Metric, DIM> mynns(indexPath, datFn, compact);
 
     std::vector<size_t> search_size_small = {10, 11, 12, 13, 15, 18, 22, 26, 28, 35, 50, 60, 70, 80, 100, 128, 156, 192, 256, 298, 348, 400, 456, 512};
 
@@ -84,7 +60,7 @@ void searchRecall(string datFn, string indexPath, string queryPath, string gtPat
             auto end = std::chrono::high_resolution_clock::now();
             float QPS = (1.0 * qryRow /
                          (1.0 * std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() / 1000.0));
-            auto recall = getRecall(searched_res, gt, RecallK);
+            auto recall = Metrics::getRecall(searched_res, gt, RecallK);
             result[sz_i].first = std::max(result[sz_i].first, QPS);
             result[sz_i].second = std::max(result[sz_i].second, recall);
             std::cout << search_size << "," << QPS << "," << recall <<  ", " << 0 << std::endl;
@@ -98,11 +74,102 @@ void searchRecall(string datFn, string indexPath, string queryPath, string gtPat
         std::cout << search_size_small[sz_i] << "," << result[sz_i].first << "," << result[sz_i].second << ",0" << std::endl;
     }
 
+    //search by recall target, at the operating points tuned for this index
+    const std::vector<EfEntry> &tuned = mynns.getEfTable().getEntries();
+    if (!tuned.empty())
+    {
+        std::cout << "topk,target_recall,efrange,cnt_per_second,recall" << std::endl;
+    }
+    for (const EfEntry &e : tuned)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < qryRow; ++i)
+        {
+            searched_res[i] = mynns.nnSearchRecall(queries[i].data(), e.topk, e.target);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        float QPS = (1.0 * qryRow /
+                     (1.0 * std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() / 1000.0));
+        auto recall = Metrics::getRecall(searched_res, gt, e.topk);
+        std::cout << e.topk << "," << e.target << "," << mynns.efrangeFor(e.topk, e.target) << "," << QPS << "," << recall << std::endl;
+    }
+}
+
+/**
+ * find the cheapest efrange reaching 'target' recall for each topk in
+ * 'topks', and save the table next to the index (see EfTable)
+ */
+template <class Metric, size_t DIM>
+void tuneEfrange(string datFn, string indexPath, string queryPath, string gtPath, bool compact,
+                 float target, std::vector<size_t> topks, size_t nSample, size_t maxEf)
+{
+    vector<vector<float>> queries = IOManager::loadFVECS(queryPath);
+    std::vector<std::vector<unsigned>> gt;
+    if (!gtPath.empty())
+    {
+        gt = IOManager::loadIVECS(gtPath);
+    }
+    NNSearch<Metric, DIM> mynns(indexPath, datFn, compact);
+
+    EfTuner<NNSearch<Metric, DIM>> tuner(mynns, queries, gt, nSample, *std::max_element(topks.begin(), topks.end()));
+    for (size_t topk : topks)
+    {
+        tuner.tune(topk, target, maxEf);
+    }
+    std::string tabFn = EfTable::pathFor(indexPath);
+    mynns.getEfTable().save(tabFn);
+
+    std::cout << "topk,target,efrange,recall" << std::endl;
+    for (const EfEntry &e : mynns.getEfTable().getEntries())
+    {
+        std::cout << e.topk << "," << e.target << "," << e.efrange << "," << e.recall << std::endl;
+    }
+    std::cout << "Saved to '" << tabFn << "'" << std::endl;
+}
+
+struct SearchArgs
+{
+    std::string indexPath, queryPath, datPath, gtPath;
+    bool compact{false};
+    float tuneTarget{0};
+    std::vector<size_t> tuneTopks;
+    size_t tuneSample{1000}, tuneMaxEf{1024};
+};
+
+template <class Metric, size_t DIM>
+void run(const SearchArgs &args)
+{
+    if (args.tuneTarget > 0)
+    {
+        tuneEfrange<Metric, DIM>(args.datPath, args.indexPath, args.queryPath, args.gtPath, args.compact,
+                                 args.tuneTarget, args.tuneTopks, args.tuneSample, args.tuneMaxEf);
+        return;
+    }
+    searchRecall<Metric, DIM>(args.datPath, args.indexPath, args.queryPath, args.gtPath, args.compact);
+}
+
+template <class Metric>
+struct SearchRunner
+{
+    const SearchArgs &args;
+
+    template <size_t DIM>
+    void run() const
+    {
+        ::run<Metric, DIM>(args);
+    }
+};
+
+template <class Metric>
+void runDim(const SearchArgs &args)
+{
+    SearchRunner<Metric> runner = {args};
+    dispatchDim(IOManager::peekFVECSDim(args.datPath), runner);
 }
 
 void callGraphDiverse()
 {
-   GraphDiverse::test();
+   GraphDiverse<>::test();
 }
 
 void help()
@@ -112,7 +179,14 @@ void help()
     std::cout << "\t-q\tfile of queries in fvecs format\n";
     std::cout << "\t-i\tindex file in ivecs format\n";
     std::cout << "\t-gt\tground-truth file in ivecs format\n";
-    std::cout << "\t-c\tcandidate vector file in fvecs format\n\n";
+    std::cout << "\t-c\tcandidate vector file in fvecs format\n";
+    std::cout << "\t-z\t1 to keep the index compressed in memory (default 0)\n";
+    std::cout << "\t-dist\tl2, ip (max. inner product) or cos (cosine), default l2\n\n";
+    std::cout << "Tuning mode (-gt is optional, brute force on the sample otherwise):\n";
+    std::cout << "\t-tune\ttarget recall, e.g. 0.95; saves the cheapest efrange per topk to indexfile.eftab\n";
+    std::cout << "\t-k\tcomma-separated topk list to tune (default 10)\n";
+    std::cout << "\t-ns\tnumber of queries to tune on (default 1000)\n";
+    std::cout << "\t-maxef\tlargest efrange to try (default 1024)\n\n";
     std::cout << "This software is developped by Wan-Lei Zhao\n";
     return;
 }
@@ -125,6 +199,10 @@ int main(int argc, char *argv[])
     std::string queryPath{""};
     std::string datPath{""};
     std::string gtPath{""};  
+    bool compact = false;
+    float tuneTarget = 0;
+    std::vector<size_t> tuneTopks;
+    size_t tuneSample = 1000, tuneMaxEf = 1024;
 
     const char *required_options[4] = {"-q", "-i", "-gt", "-c"};
     int required[4] = {0, 0, 0, 0};
@@ -162,10 +240,44 @@ int main(int argc, char *argv[])
             datPath = argv[i + 1];
             required[3] = 1;
         }
+        else if (strcmp(argv[i], "-z") == 0)
+        {
+            compact = atoi(argv[i + 1]) != 0;
+        }
+        else if (strcmp(argv[i], "-dist") == 0)
+        {
+            dist_func = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-tune") == 0)
+        {
+            tuneTarget = atof(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-k") == 0)
+        {
+            std::stringstream ss(argv[i + 1]);
+            std::string tok;
+            while (std::getline(ss, tok, ','))
+            {
+                tuneTopks.push_back(atoi(tok.c_str()));
+            }
+        }
+        else if (strcmp(argv[i], "-ns") == 0)
+        {
+            tuneSample = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-maxef") == 0)
+        {
+            tuneMaxEf = atoi(argv[i + 1]);
+        }
     }
     bool __missed__ = false;
-    for (int i = 0; i < 3; i++)
+    for (int i = 0; i < 4; i++)
     {
+        //the ground truth can be computed by brute force when tuning
+        if (i == 2 && tuneTarget > 0)
+        {
+            continue;
+        }
         if (required[i] == 0)
         {
             std::cout << "Required option '" << required_options[i] << "' is missing!\n";
@@ -176,7 +288,38 @@ int main(int argc, char *argv[])
     {
         return 0;
     }
-    searchRecall(datPath, indexPath, queryPath, gtPath);
+    if (tuneTarget > 0 && tuneTopks.empty())
+    {
+        tuneTopks.push_back(10);
+    }
+
+    SearchArgs args;
+    args.indexPath = indexPath;
+    args.queryPath = queryPath;
+    args.datPath = datPath;
+    args.gtPath = gtPath;
+    args.compact = compact;
+    args.tuneTarget = tuneTarget;
+    args.tuneTopks = tuneTopks;
+    args.tuneSample = tuneSample;
+    args.tuneMaxEf = tuneMaxEf;
+
+    if (dist_func == "l2")
+    {
+        runDim<L2Metric>(args);
+    }
+    else if (dist_func == "ip")
+    {
+        runDim<IPMetric>(args);
+    }
+    else if (dist_func == "cos")
+    {
+        runDim<CosineMetric>(args);
+    }
+    else
+    {
+        std::cout << "Unknown distance '" << dist_func << "'!\n";
+    }
 
     return 0;
 }
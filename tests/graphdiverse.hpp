@@ -1,6 +1,7 @@
 #pragma once;
 
 #include <algorithm>
+#include <cstdio>
 #include <string>
 
 #include "../src/metrics.hpp"
@@ -31,9 +32,169 @@ public:
     }
 };
 
+/**
+ * Metric: L2Metric, IPMetric or CosineMetric (see metrics.hpp)
+ * DIM: as for NNSearch
+ */
+template <class Metric = L2Metric, size_t DIM = 0>
 class GraphDiverse
 {
+private:
+    // distance between vectors x and y, vector x being at 'dat + x * stride'
+    static inline float dist(const float *dat, size_t stride, size_t nDim, const float *aux, size_t x, size_t y)
+    {
+        return Metric::template dist<DIM>(dat + x * stride, dat + y * stride, nDim,
+                                          Metric::NEEDS_AUX ? aux[x] : 0.0f, Metric::NEEDS_AUX ? aux[y] : 0.0f);
+    }
+
+    // Metric::aux() of all the vectors, empty if the metric needs none
+    static std::vector<float> computeAux(const float *dat, size_t stride, size_t nRow, size_t nDim)
+    {
+        std::vector<float> aux;
+        if (Metric::NEEDS_AUX)
+        {
+            aux.resize(nRow);
+            for (size_t i = 0; i < nRow; i++)
+            {
+                aux[i] = Metric::aux(dat + i * stride, nDim);
+            }
+        }
+        return aux;
+    }
+
+    // keep the aux values next to the index, for NNSearch to load
+    static void saveAux(const std::string &dstFn, std::vector<float> &aux)
+    {
+        if (!aux.empty())
+        {
+            std::vector<std::vector<float>> rows(1);
+            rows[0].swap(aux);
+            IOManager::saveFVECS(IOManager::normsPathFor(dstFn), rows);
+            rows[0].swap(aux);
+        }
+    }
+
+    static void checkDim(size_t nDim)
+    {
+        if (DIM > 0 && nDim != DIM)
+        {
+            std::cerr << "Data of dimension " << nDim << " given to a build specialized for " << DIM << "!\n";
+            exit(0);
+        }
+    }
+    /**
+     * diversify the k-NN list 'nbhood' of node 'i' into 'divNb' (a
+     * neighbor is dropped when it is closer to a kept neighbor than to
+     * 'i'), and return the radius of 'i', i.e. its distance to the last
+     * k-NN. Vector x is at 'dat + x * stride'.
+     */
+    static float diversifyKNN(const std::vector<unsigned> &nbhood, unsigned i, const float *dat,
+                              size_t stride, size_t nDim, const float *aux, std::vector<unsigned> &divNb)
+    {
+        divNb.emplace_back(nbhood[0]);
+        float *host2nbs = new float[nbhood.size()];
+        for (unsigned j = 0; j < nbhood.size(); j++)
+        {
+            host2nbs[j] = dist(dat, stride, nDim, aux, i, nbhood[j]);
+        }
+        float radius = host2nbs[nbhood.size() - 1];
+
+        for (unsigned j = 1; j < nbhood.size(); j++)
+        {
+            bool __occlude__ = false;
+            unsigned y = nbhood[j];
+            for (unsigned k = 0; k < divNb.size(); k++)
+            {
+                unsigned x = divNb[k];
+                float distxy = dist(dat, stride, nDim, aux, x, y);
+                if (distxy < host2nbs[j])
+                {
+                    __occlude__ = true;
+                    break;
+                }
+            }
+            if (__occlude__ == false)
+            {
+                divNb.emplace_back(y);
+            }
+        } // for(j)
+        delete[] host2nbs;
+        host2nbs = nullptr;
+        return radius;
+    }
+
+    /**
+     * diversify the reverse neighbors 'rvsNb' of node 'i', and append
+     * the ones that survive to 'divNb', until it has 64 neighbors
+     */
+    static void diversifyRvs(std::vector<unsigned> &divNb, const std::vector<unsigned> &rvsNb, unsigned i,
+                             const float *dat, size_t stride, size_t nDim, const float *aux)
+    {
+        std::vector<unsigned> tmpNbs;
+        for (unsigned j = 0; j < divNb.size(); j++)
+        {
+            tmpNbs.emplace_back(divNb[j]);
+        }
+        for (unsigned j = 0; j < rvsNb.size(); j++)
+        {
+            tmpNbs.emplace_back(rvsNb[j]);
+        }
+        std::vector<IdxItem> host2nbs;
+        for (unsigned j = 0; j < tmpNbs.size(); j++)
+        {
+            host2nbs.emplace_back(IdxItem(tmpNbs[j], dist(dat, stride, nDim, aux, i, tmpNbs[j])));
+        }
+        stable_sort(host2nbs.begin(), host2nbs.end());
+        unsigned nbsz = divNb.size();
+        for (unsigned j = nbsz; j < host2nbs.size(); j++)
+        {
+            bool __occlude__ = false;
+            unsigned y = host2nbs[j].idx; // 获取当前邻居节点的索引
+            for (unsigned k = 0; k < divNb.size(); k++)
+            {
+                unsigned x = divNb[k];
+                float distxy = dist(dat, stride, nDim, aux, x, y);
+                if (distxy < host2nbs[j].dst)
+                {
+                    __occlude__ = true;
+                    break;
+                }
+            }
+            if (__occlude__ == false)
+            {
+                divNb.emplace_back(y);
+                //restrict the size of the neighborhood, no larger than 64
+                if (divNb.size() >= 64)
+                {
+                    break;
+                }
+            }
+        }
+        host2nbs.clear();
+    }
+
+    static std::string bucketFn(const std::string &dstFn, size_t b)
+    {
+        return dstFn + ".rvs" + std::to_string(b) + ".tmp";
+    }
 
+    // append the (node, reverse neighbor) pairs of 'bucket' to its spill file
+    static void flushBucket(const std::string &dstFn, size_t b, std::vector<unsigned> &bucket)
+    {
+        if (bucket.empty())
+        {
+            return;
+        }
+        std::ofstream outStrm(bucketFn(dstFn, b), ios::out | ios::binary | ios::app);
+        if (!outStrm.is_open())
+        {
+            std::cerr << "File '" << bucketFn(dstFn, b) << "' cannot open for write!" << std::endl;
+            exit(0);
+        }
+        outStrm.write((char *)bucket.data(), bucket.size() * sizeof(unsigned));
+        outStrm.close();
+        bucket.clear();
+    }
 
 public:
     void triagDiverse(std::string knnFn, std::string dataFn, std::string dstFn)
@@ -47,6 +208,8 @@ public:
 
         std::cout << "Graph Size: " << knnGraph.size() << std::endl;
         std::cout << "Data Size: " << nRow << "x" << nDim  << std::endl;
+        checkDim(nDim);
+        std::vector<float> aux = computeAux(rawDat, nDim, nRow, nDim);
 
         for (unsigned i = 0; i < knnGraph.size(); i++)
         {
@@ -60,39 +223,7 @@ public:
         //diversify on the k-NN lists
         for (unsigned i = 0; i < knnGraph.size(); i++)
         {
-            std::vector<unsigned> &nbhood = knnGraph[i];
-            std::vector<unsigned> &divNb = divGraph[i];
-            divNb.emplace_back(nbhood[0]);
-            float *host2nbs = new float[nbhood.size()];
-            unsigned hloc = nDim * i;
-            for (unsigned j = 0; j < nbhood.size(); j++)
-            {
-                unsigned nbloc = nDim * nbhood[j];
-                host2nbs[j] = Metrics::l2dst(rawDat + hloc, rawDat + nbloc, nDim);
-            }
-            radius[i] = host2nbs[nbhood.size() - 1];
-
-            for (unsigned j = 1; j < nbhood.size(); j++)
-            {
-                bool __occlude__ = false;
-                unsigned y = nbhood[j];
-                for (unsigned k = 0; k < divNb.size(); k++)
-                {
-                    unsigned x = divNb[k];
-                    float distxy = Metrics::l2dst(rawDat + x * nDim, rawDat + y * nDim, nDim);
-                    if (distxy < host2nbs[j])
-                    {
-                        __occlude__ = true;
-                        break;
-                    }
-                }
-                if (__occlude__ == false)
-                {
-                    divNb.emplace_back(y);
-                }
-            } // for(j)
-            delete[] host2nbs;
-            host2nbs = nullptr;
+            radius[i] = diversifyKNN(knnGraph[i], i, rawDat, nDim, nDim, aux.data(), divGraph[i]);
         } //(for i)
 
         // collect reverse-nb graph
@@ -103,8 +234,7 @@ public:
             {
                 unsigned nb = divNb[j];
                 std::vector<unsigned> &nbhood = rvsGraph[nb];
-                float dist = Metrics::l2dst(rawDat + nb * nDim, rawDat + i * nDim, nDim);
-                if (dist > radius[nb])
+                if (dist(rawDat, nDim, nDim, aux.data(), nb, i) > radius[nb])
                 {
                     nbhood.emplace_back(i);
                 }
@@ -114,69 +244,191 @@ public:
         // diversify on reverse Graph, and append to the diversified k-NN list
         for (unsigned i = 0; i < divGraph.size(); i++)
         {
-            std::vector<unsigned> &divNb = divGraph[i];
-            std::vector<unsigned> &rvsNb = rvsGraph[i];
-            std::vector<unsigned> tmpNbs;
+            diversifyRvs(divGraph[i], rvsGraph[i], i, rawDat, nDim, nDim, aux.data());
+        } //(for i)
+
+        IOManager::saveIVECS(dstFn, divGraph);
+        saveAux(dstFn, aux);
+
+        knnGraph.clear();
+        rvsGraph.clear();
+        divGraph.clear();
+        delete[] rawDat;
+        rawDat = nullptr;
+        delete[] radius;
+        radius = nullptr;
+    }
+
+    /**
+     * Same output as triagDiverse(), with a peak memory bounded by about
+     * 'memBudgetMB' instead of several times the index size:
+     * 1. the vectors are mapped (IOManager::mapFVECS) rather than loaded
+     * 2. k-NN lists are diversified one at a time as they are read; the
+     *    result goes to a temp file, and the reverse edges are spilled
+     *    to one bucket file per block of nodes
+     * 3. block by block, the diversified lists and the bucket are read
+     *    back, the reverse lists are diversified, and the rows are
+     *    appended to 'dstFn'
+     * Temp files are created next to 'dstFn' and removed at the end.
+     * Metrics with per-vector aux values (cosine) keep them in memory,
+     * i.e. 4 bytes per vector on top of the budget.
+     */
+    void triagDiverseStream(std::string knnFn, std::string dataFn, std::string dstFn, size_t memBudgetMB = 1024)
+    {
+        size_t nRow = 0, nDim = 0, mapLen = 0;
+        float *mapDat = IOManager::mapFVECS(dataFn, nRow, nDim, mapLen);
+        const float *dat = mapDat + 1; // skip the dim word of each row
+        size_t stride = nDim + 1;
+
+        ifstream knnStrm(knnFn, ios::binary);
+        if (!knnStrm.is_open())
+        {
+            std::cerr << "File '" << knnFn << "' cannot open for read!\n";
+            exit(0);
+        }
+        unsigned int k = 0;
+        knnStrm.read((char *)&k, sizeof(unsigned int));
+        knnStrm.seekg(0, ios::beg);
+
+        // half of the budget for a block of nodes (k-NN, diversified, reverse
+        // and output lists, the reverse lists being k long on average) ...
+        size_t half = (std::max<size_t>(memBudgetMB, 1) << 20) / 2;
+        size_t bytesPerNode = 3 * sizeof(std::vector<unsigned>) + sizeof(float) + (2 * k + 64) * sizeof(unsigned);
+        size_t blockRows = std::max<size_t>(1, half / bytesPerNode);
+        size_t nBlocks = std::max<size_t>(1, (nRow + blockRows - 1) / blockRows);
+        // ... and the other half for the write buffers of the buckets, one per block
+        const size_t minBufCap = 512;
+        size_t bytesPerBucket = half / nBlocks;
+        if (bytesPerBucket < sizeof(std::vector<unsigned>) + minBufCap * sizeof(unsigned))
+        {
+            double needMB = 2 * sqrt((double)nRow * bytesPerNode * (sizeof(std::vector<unsigned>) + minBufCap * sizeof(unsigned)));
+            std::cerr << "Memory budget of " << memBudgetMB << " MB is too small for " << nRow << " rows, about "
+                      << (size_t)(needMB / (1 << 20)) + 1 << " MB is needed!" << std::endl;
+            exit(0);
+        }
+        size_t bufCap = (bytesPerBucket - sizeof(std::vector<unsigned>)) / sizeof(unsigned) & ~(size_t)1;
+
+        std::cout << "Data Size: " << nRow << "x" << nDim << std::endl;
+        std::cout << "Blocks: " << nBlocks << "x" << blockRows << std::endl;
+        checkDim(nDim);
+        std::vector<float> aux = computeAux(dat, stride, nRow, nDim);
+
+        std::string divFn = dstFn + ".div.tmp";
+        std::ofstream divStrm(divFn, ios::out | ios::binary);
+        if (!divStrm.is_open())
+        {
+            std::cerr << "File '" << divFn << "' cannot open for write!" << std::endl;
+            exit(0);
+        }
+        // bufCap is even and pairs are pushed, so a bucket is flushed right at
+        // bufCap and never outgrows the capacity reserved here
+        std::vector<std::vector<unsigned>> buckets(nBlocks);
+        for (size_t b = 0; b < nBlocks; b++)
+        {
+            buckets[b].reserve(bufCap);
+            std::remove(bucketFn(dstFn, b).c_str());
+        }
+
+        //diversify on the k-NN lists, and spill the reverse edges
+        std::vector<unsigned> nbhood, divNb;
+        unsigned int dim = 0;
+        size_t i = 0;
+        for (; i < nRow && knnStrm.read((char *)&dim, sizeof(unsigned int)); i++)
+        {
+            nbhood.resize(dim);
+            knnStrm.read((char *)nbhood.data(), dim * sizeof(unsigned int));
+            divNb.clear();
+            float radius = diversifyKNN(nbhood, i, dat, stride, nDim, aux.data(), divNb);
+
+            unsigned int divsz = divNb.size();
+            divStrm.write((char *)&radius, sizeof(float));
+            divStrm.write((char *)&divsz, sizeof(unsigned int));
+            divStrm.write((char *)divNb.data(), divsz * sizeof(unsigned int));
             for (unsigned j = 0; j < divNb.size(); j++)
             {
-                tmpNbs.emplace_back(divNb[j]);
-            }
-            for (unsigned j = 0; j < rvsNb.size(); j++)
-            {
-                tmpNbs.emplace_back(rvsNb[j]);
+                size_t b = divNb[j] / blockRows;
+                buckets[b].push_back(divNb[j]);
+                buckets[b].push_back(i);
+                if (buckets[b].size() >= bufCap)
+                {
+                    flushBucket(dstFn, b, buckets[b]);
+                }
             }
-            std::vector<IdxItem> host2nbs;
-            unsigned hloc = nDim * i;
-            for (unsigned j = 0; j < tmpNbs.size(); j++)
+        } //(for i)
+        knnStrm.close();
+        divStrm.close();
+        if (i != nRow)
+        {
+            std::cerr << "Graph '" << knnFn << "' has " << i << " rows, " << nRow << " expected!" << std::endl;
+            exit(0);
+        }
+        for (size_t b = 0; b < nBlocks; b++)
+        {
+            flushBucket(dstFn, b, buckets[b]);
+            std::vector<unsigned>().swap(buckets[b]);
+        }
+
+        std::ifstream divIn(divFn, ios::binary);
+        std::ofstream outStrm(dstFn, ios::out | ios::binary);
+        if (!outStrm.is_open())
+        {
+            std::cerr << "File '" << dstFn << "' cannot open for write!" << std::endl;
+            exit(0);
+        }
+        std::vector<unsigned> pairs;
+        for (size_t b = 0; b < nBlocks; b++)
+        {
+            size_t lo = b * blockRows, hi = std::min(nRow, lo + blockRows);
+            std::vector<std::vector<unsigned>> divBlock(hi - lo), rvsBlock(hi - lo);
+            std::vector<float> radius(hi - lo);
+            for (size_t j = 0; j < hi - lo; j++)
             {
-                unsigned nbloc = nDim * tmpNbs[j];
-                float dist = Metrics::l2dst(rawDat + hloc, rawDat + nbloc, nDim);
-                host2nbs.emplace_back(IdxItem(tmpNbs[j], dist));
+                unsigned int divsz = 0;
+                divIn.read((char *)&radius[j], sizeof(float));
+                divIn.read((char *)&divsz, sizeof(unsigned int));
+                divBlock[j].resize(divsz);
+                divIn.read((char *)divBlock[j].data(), divsz * sizeof(unsigned int));
             }
-            stable_sort(host2nbs.begin(), host2nbs.end());
-            unsigned nbsz = divNb.size();
-            for (unsigned j = nbsz; j < host2nbs.size(); j++)
+
+            // collect reverse-nb lists of this block, in the order of triagDiverse()
+            std::ifstream bktIn(bucketFn(dstFn, b), ios::binary);
+            pairs.resize(bufCap);
+            while (bktIn.is_open())
             {
-                bool __occlude__ = false;
-                /**
-                filling your code here
-                **/
-               unsigned y = host2nbs[j].idx; // 获取当前邻居节点的索引
-                for (unsigned k = 0; k < divNb.size(); k++)
+                bktIn.read((char *)pairs.data(), bufCap * sizeof(unsigned));
+                size_t npair = bktIn.gcount() / (2 * sizeof(unsigned));
+                if (npair == 0)
                 {
-                    unsigned x = divNb[k];
-                    float distxy = Metrics::l2dst(rawDat + x * nDim, rawDat + y * nDim, nDim);
-                    if (distxy < host2nbs[j].dst)
-                    {
-                        __occlude__ = true;
-                        break;
-                    }
+                    break;
                 }
-                if (__occlude__ == false)
+                for (size_t p = 0; p < npair; p++)
                 {
-                    divNb.emplace_back(y);
-                    //restrict the size of the neighborhood, no larger than 64
-                    if (divNb.size() >= 64)
+                    unsigned nb = pairs[2 * p], x = pairs[2 * p + 1];
+                    if (dist(dat, stride, nDim, aux.data(), nb, x) > radius[nb - lo])
                     {
-                        break;
+                        rvsBlock[nb - lo].emplace_back(x);
                     }
                 }
             }
-            host2nbs.clear();
-        } //(for i)
-
-        IOManager::saveIVECS(dstFn, divGraph);
+            bktIn.close();
+            std::remove(bucketFn(dstFn, b).c_str());
 
-        knnGraph.clear();
-        rvsGraph.clear();
-        divGraph.clear();
-        delete[] rawDat;
-        rawDat = nullptr;
-        delete[] radius;
-        radius = nullptr;
+            // diversify on reverse lists, and write the block out
+            for (size_t j = 0; j < hi - lo; j++)
+            {
+                diversifyRvs(divBlock[j], rvsBlock[j], lo + j, dat, stride, nDim, aux.data());
+                dim = divBlock[j].size();
+                outStrm.write((char *)&dim, sizeof(unsigned int));
+                outStrm.write((char *)divBlock[j].data(), dim * sizeof(unsigned int));
+            }
+        }
+        divIn.close();
+        outStrm.close();
+        std::remove(divFn.c_str());
+        saveAux(dstFn, aux);
+        IOManager::unmapFVECS(mapDat, mapLen);
     }
 
-
     static void test()
     {
         std::string dataFn1 = "/home/wlzhao/datasets/bignn/sift1m/sift1m_base.fvecs";
@@ -189,6 +441,8 @@ public:
 
         GraphDiverse gd;
         gd.triagDiverse(knnFn1, dataFn1, idxFn1);
+        //for large datasets, bound the peak memory (in MB) instead
+        //gd.triagDiverseStream(knnFn1, dataFn1, idxFn1, 2048);
     }
 };
 }
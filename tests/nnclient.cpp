@@ -0,0 +1,267 @@
+#include "../src/iomanager.hpp"
+#include "../src/nnproto.hpp"
+#include "../src/metrics.hpp"
+
+#include <signal.h>
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+
+/***
+ * @brief Open-loop load generator for 'nnserver'. Each connection
+ * sends its share of the target QPS on a fixed schedule, and latency
+ * is taken from the scheduled send time, so a stalled server shows up
+ * in the tail rather than slowing down the client.
+ *
+ * @copyright All rights are reserved by the author
+ */
+
+using namespace std;
+using namespace cmmlab;
+
+typedef std::chrono::steady_clock Clock;
+
+struct ConnState
+{
+    int fd{-1};
+    std::vector<Clock::time_point> sched; // scheduled send time, by reqId
+    std::vector<double> latUs;            // by reqId, < 0 for no answer
+    std::vector<std::vector<unsigned>> results;
+    size_t nFailed{0};
+};
+
+static void sendLoop(ConnState *cs, const vector<vector<float>> *queries, size_t connId, size_t nConn,
+                     size_t topk, size_t efrange)
+{
+    size_t dim = (*queries)[0].size();
+    std::vector<char> msg(sizeof(nnproto::ReqHeader) + dim * sizeof(float));
+    for (size_t r = 0; r < cs->sched.size(); r++)
+    {
+        std::this_thread::sleep_until(cs->sched[r]);
+        const vector<float> &qry = (*queries)[(r * nConn + connId) % queries->size()];
+        nnproto::ReqHeader hdr = {nnproto::MAGIC, nnproto::OP_SEARCH, (uint32_t)r,
+                                  (uint32_t)topk, (uint32_t)efrange, (uint32_t)dim};
+        memcpy(msg.data(), &hdr, sizeof(hdr));
+        memcpy(msg.data() + sizeof(hdr), qry.data(), dim * sizeof(float));
+        if (!nnproto::writeFull(cs->fd, msg.data(), msg.size()))
+        {
+            break;
+        }
+    }
+}
+
+static void recvLoop(ConnState *cs)
+{
+    nnproto::RspHeader rsp;
+    std::vector<unsigned> ids;
+    for (size_t n = 0; n < cs->sched.size(); n++)
+    {
+        if (!nnproto::readFull(cs->fd, &rsp, sizeof(rsp)))
+        {
+            break;
+        }
+        ids.resize(rsp.count);
+        if (!nnproto::readFull(cs->fd, ids.data(), rsp.count * sizeof(unsigned)))
+        {
+            break;
+        }
+        if (rsp.reqId >= cs->sched.size())
+        {
+            continue;
+        }
+        if (rsp.status != nnproto::ST_OK)
+        {
+            cs->nFailed++;
+            continue;
+        }
+        auto d = Clock::now() - cs->sched[rsp.reqId];
+        cs->latUs[rsp.reqId] = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / 1000.0;
+        cs->results[rsp.reqId] = ids;
+    }
+}
+
+static bool fetchStats(const std::string &sockPath, unsigned short port, std::vector<uint64_t> &words)
+{
+    int fd = nnproto::connectTo(sockPath, port);
+    if (fd < 0)
+    {
+        return false;
+    }
+    nnproto::ReqHeader hdr = {nnproto::MAGIC, nnproto::OP_STATS, 0, 0, 0, 0};
+    nnproto::RspHeader rsp;
+    bool ok = nnproto::writeFull(fd, &hdr, sizeof(hdr)) && nnproto::readFull(fd, &rsp, sizeof(rsp));
+    if (ok)
+    {
+        words.resize(rsp.count);
+        ok = nnproto::readFull(fd, words.data(), rsp.count * sizeof(uint64_t));
+    }
+    ::close(fd);
+    return ok;
+}
+
+void help()
+{
+    std::cout << "nnclient -q queryfile [-s sockfile | -p port] [-r qps] [-n conns] [-d seconds] [-k topk] [-e efrange] [-gt gtfile.ivecs]\n\n";
+    std::cout << "Options:\n";
+    std::cout << "\t-q\tfile of queries in fvecs format\n";
+    std::cout << "\t-s\tUnix domain socket of the server (default /tmp/nns.sock)\n";
+    std::cout << "\t-p\tconnect to 127.0.0.1:port instead of a Unix socket\n";
+    std::cout << "\t-r\ttarget queries per second, over all connections (default 1000)\n";
+    std::cout << "\t-n\tnumber of connections (default 4)\n";
+    std::cout << "\t-d\tduration of the test in seconds (default 10)\n";
+    std::cout << "\t-k\ttopk (default 10)\n";
+    std::cout << "\t-e\tefrange (default 64)\n";
+    std::cout << "\t-gt\tground-truth file in ivecs format, to report recall as well\n\n";
+    return;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string queryPath{""};
+    std::string gtPath{""};
+    std::string sockPath{"/tmp/nns.sock"};
+    unsigned short port = 0;
+    double qps = 1000, seconds = 10;
+    size_t nConn = 4, topk = 10, efrange = 64;
+
+    if (argc < 3)
+    {
+        help();
+        return 0;
+    }
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "-q") == 0)
+            queryPath = argv[i + 1];
+        else if (strcmp(argv[i], "-gt") == 0)
+            gtPath = argv[i + 1];
+        else if (strcmp(argv[i], "-s") == 0)
+            sockPath = argv[i + 1];
+        else if (strcmp(argv[i], "-p") == 0)
+            port = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-r") == 0)
+            qps = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "-n") == 0)
+            nConn = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-d") == 0)
+            seconds = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "-k") == 0)
+            topk = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-e") == 0)
+            efrange = atoi(argv[i + 1]);
+    }
+    if (queryPath.empty() || qps <= 0 || nConn == 0)
+    {
+        help();
+        return 0;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    vector<vector<float>> queries = IOManager::loadFVECS(queryPath);
+    if (queries.empty())
+    {
+        std::cerr << "No queries in '" << queryPath << "'!\n";
+        return 1;
+    }
+
+    // spread the sends evenly: connection c sends at t0 + (r * nConn + c) / qps
+    size_t nPerConn = std::max<size_t>(1, (size_t)(qps * seconds / nConn));
+    std::vector<ConnState> conns(nConn);
+    auto t0 = Clock::now() + std::chrono::milliseconds(100);
+    for (size_t c = 0; c < nConn; c++)
+    {
+        ConnState &cs = conns[c];
+        cs.fd = nnproto::connectTo(sockPath, port);
+        if (cs.fd < 0)
+        {
+            std::cerr << "Cannot connect to the server!\n";
+            return 1;
+        }
+        cs.sched.resize(nPerConn);
+        cs.latUs.assign(nPerConn, -1);
+        cs.results.resize(nPerConn);
+        for (size_t r = 0; r < nPerConn; r++)
+        {
+            double at = (r * nConn + c) / qps;
+            cs.sched[r] = t0 + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(at));
+        }
+    }
+
+    std::vector<std::thread> thrds;
+    for (size_t c = 0; c < nConn; c++)
+    {
+        thrds.emplace_back(sendLoop, &conns[c], &queries, c, nConn, topk, efrange);
+        thrds.emplace_back(recvLoop, &conns[c]);
+    }
+    for (auto &t : thrds)
+    {
+        t.join();
+    }
+    auto t1 = Clock::now();
+
+    std::vector<double> lats;
+    size_t nFailed = 0;
+    for (ConnState &cs : conns)
+    {
+        ::close(cs.fd);
+        nFailed += cs.nFailed;
+        for (double l : cs.latUs)
+        {
+            if (l >= 0)
+                lats.push_back(l);
+        }
+    }
+    std::sort(lats.begin(), lats.end());
+    double elapsed = std::chrono::duration<double>(t1 - t0).count();
+    size_t nSent = nPerConn * nConn;
+
+    std::cout << "sent,answered,failed,target_qps,achieved_qps\n";
+    std::cout << nSent << "," << lats.size() << "," << nFailed << "," << qps << ","
+              << (elapsed > 0 ? lats.size() / elapsed : 0) << "\n";
+    if (!lats.empty())
+    {
+        auto pct = [&lats](double p)
+        { return lats[std::min(lats.size() - 1, (size_t)(p * lats.size()))]; };
+        std::cout << "p50_us,p90_us,p99_us,p999_us,max_us\n";
+        std::cout << pct(0.5) << "," << pct(0.9) << "," << pct(0.99) << "," << pct(0.999) << "," << lats.back() << "\n";
+    }
+
+    if (!gtPath.empty())
+    {
+        std::vector<std::vector<unsigned>> gt = IOManager::loadIVECS(gtPath);
+        std::vector<std::vector<unsigned>> anns(queries.size());
+        for (size_t c = 0; c < nConn; c++)
+        {
+            for (size_t r = 0; r < nPerConn; r++)
+            {
+                size_t q = (r * nConn + c) % queries.size();
+                if (anns[q].empty())
+                    anns[q] = conns[c].results[r];
+            }
+        }
+        // only the queries that got an answer are scored
+        std::vector<std::vector<unsigned>> answered, answeredGt;
+        for (size_t q = 0; q < std::min(anns.size(), gt.size()); q++)
+        {
+            if (!anns[q].empty())
+            {
+                answered.push_back(anns[q]);
+                answeredGt.push_back(gt[q]);
+            }
+        }
+        std::cout << "recall@" << topk << " .......................... " << Metrics::getRecall(answered, answeredGt, topk) << "\n";
+    }
+
+    std::vector<uint64_t> words;
+    if (fetchStats(sockPath, port, words))
+    {
+        std::cout << "-------- server counters -------" << std::endl;
+        nnproto::printStats(words, std::cout);
+    }
+    return 0;
+}
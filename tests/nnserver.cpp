@@ -0,0 +1,209 @@
+#include "../src/iomanager.hpp"
+#include "../src/nnsearch.hpp"
+#include "../src/nnserver.hpp"
+
+#include <signal.h>
+#include <iostream>
+#include <cstring>
+#include <string>
+
+/***
+ * @brief Query-serving daemon: opens the index once and answers
+ * queries sent by 'nnclient' (or any client speaking nnproto.hpp)
+ * until it gets SIGINT/SIGTERM, then prints its counters.
+ *
+ * @copyright All rights are reserved by the author
+ */
+
+using namespace std;
+using namespace cmmlab;
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void onSignal(int)
+{
+    stopRequested = 1;
+}
+
+struct ServeArgs
+{
+    std::string indexPath, datPath, sockPath;
+    unsigned short port{0};
+    size_t nThreads{1}, maxBatch{8}, batchWaitUs{0}, cacheSize{0}, maxQueue{4096};
+    bool compact{false};
+};
+
+template <class Metric, size_t DIM>
+int serve(const ServeArgs &args)
+{
+    typedef NNSearch<Metric, DIM> Search;
+    Search mynns(args.indexPath, args.datPath, args.compact);
+    NNServer<Search> server(mynns, args.nThreads, args.maxBatch, args.batchWaitUs, args.maxQueue);
+    std::unique_ptr<QueryCache> cache;
+    if (args.cacheSize > 0)
+    {
+        cache.reset(new QueryCache(args.cacheSize, mynns.getDim()));
+        server.setCache(cache.get());
+    }
+    bool ok = args.port > 0 ? server.listenTCP(args.port) : server.listenUnix(args.sockPath);
+    if (!ok)
+    {
+        return 1;
+    }
+
+    server.setStopFlag(&stopRequested);
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (args.port > 0)
+        std::cout << "Listening on ...................... 127.0.0.1:" << args.port << std::endl;
+    else
+        std::cout << "Listening on ...................... " << args.sockPath << std::endl;
+    std::cout << "Metric ............................ " << Metric::name() << std::endl;
+    std::cout << "Workers x batch ................... " << args.nThreads << "x" << args.maxBatch << std::endl;
+
+    server.run();
+
+    nnproto::printStats(server.getStats(), std::cout);
+    return 0;
+}
+
+template <class Metric>
+struct ServeRunner
+{
+    const ServeArgs &args;
+
+    template <size_t DIM>
+    int run() const
+    {
+        return serve<Metric, DIM>(args);
+    }
+};
+
+template <class Metric>
+int serveDim(const ServeArgs &args)
+{
+    ServeRunner<Metric> runner = {args};
+    return dispatchDim(IOManager::peekFVECSDim(args.datPath), runner);
+}
+
+void help()
+{
+    std::cout << "nnserver -i indexfile.ivecs -c candis.fvecs [-s sockfile | -p port] [-t threads] [-b batch] [-w waitus] [-d depth] [-z 0|1] [-m entries] [-dist l2|ip|cos]\n\n";
+    std::cout << "Options:\n";
+    std::cout << "\t-i\tindex file in ivecs format\n";
+    std::cout << "\t-c\tcandidate vector file in fvecs format\n";
+    std::cout << "\t-s\tUnix domain socket to listen on (default /tmp/nns.sock)\n";
+    std::cout << "\t-p\tlisten on 127.0.0.1:port instead of a Unix socket\n";
+    std::cout << "\t-t\tnumber of search workers (default: number of cores)\n";
+    std::cout << "\t-b\tmax. number of requests taken by a worker at once (default 8)\n";
+    std::cout << "\t-w\tmax. microseconds a worker waits for a batch to fill up (default 0)\n";
+    std::cout << "\t-d\tmax. number of queued requests, beyond which they are answered busy (default 4096)\n";
+    std::cout << "\t-z\t1 to keep the index compressed in memory (default 0)\n";
+    std::cout << "\t-m\tcache the results of up to this many queries (default 0, no cache)\n";
+    std::cout << "\t-dist\tl2, ip (max. inner product) or cos (cosine), default l2\n\n";
+    return;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string indexPath{""};
+    std::string datPath{""};
+    std::string sockPath{"/tmp/nns.sock"};
+    unsigned short port = 0;
+    size_t nThreads = std::thread::hardware_concurrency();
+    size_t maxBatch = 8, batchWaitUs = 0, maxQueue = 4096;
+    bool compact = false;
+    size_t cacheSize = 0;
+    std::string dist_func{"l2"};
+
+    if (argc < 5)
+    {
+        help();
+        return 0;
+    }
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "-i") == 0)
+        {
+            indexPath = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-c") == 0)
+        {
+            datPath = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-s") == 0)
+        {
+            sockPath = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-p") == 0)
+        {
+            port = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-t") == 0)
+        {
+            nThreads = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-b") == 0)
+        {
+            maxBatch = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-w") == 0)
+        {
+            batchWaitUs = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-d") == 0)
+        {
+            maxQueue = atol(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-z") == 0)
+        {
+            compact = atoi(argv[i + 1]) != 0;
+        }
+        else if (strcmp(argv[i], "-m") == 0)
+        {
+            cacheSize = atol(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-dist") == 0)
+        {
+            dist_func = argv[i + 1];
+        }
+    }
+    if (indexPath.empty() || datPath.empty())
+    {
+        help();
+        return 0;
+    }
+    nThreads = std::max<size_t>(nThreads, 1);
+    maxBatch = std::max<size_t>(maxBatch, 1);
+    maxQueue = std::max<size_t>(maxQueue, 1);
+
+    ServeArgs args;
+    args.indexPath = indexPath;
+    args.datPath = datPath;
+    args.sockPath = sockPath;
+    args.port = port;
+    args.nThreads = nThreads;
+    args.maxBatch = maxBatch;
+    args.batchWaitUs = batchWaitUs;
+    args.maxQueue = maxQueue;
+    args.cacheSize = cacheSize;
+    args.compact = compact;
+
+    if (dist_func == "l2")
+    {
+        return serveDim<L2Metric>(args);
+    }
+    else if (dist_func == "ip")
+    {
+        return serveDim<IPMetric>(args);
+    }
+    else if (dist_func == "cos")
+    {
+        return serveDim<CosineMetric>(args);
+    }
+    std::cout << "Unknown distance '" << dist_func << "'!\n";
+    return 0;
+}